@@ -14,11 +14,13 @@
 #include <fstream>
 #include <string>
 #include <cstring>
+#include <vector>
 #include <unistd.h>
 
 #include "error.h"
 #include "tools.h"
 #include "database.h" 
+#include "sketch.h"
 
 extern bool g_debug;
 extern bool g_query;
@@ -34,6 +36,8 @@ using std::string;
 * hash = hash of block,
 * blocks = block count,
 * bytes = compressed bytes
+* tags = bitmask of the tags (groups) of the files that contain the block,
+*        bit n-1 for tag id n (max 63 tags)
 * 
 * metadata table keeps track of blocksize and other info - 
 * Cannot chance blocksize once created. Force metadata to have one row only.
@@ -85,6 +89,18 @@ int Query::bind(const char* p) {
 
 int Query::bind(const string& p) { return bind(p.c_str()); };
 
+int Query::bindf(double p) {
+  int rc = sqlite3_bind_double(pStmt, ++ref, p);
+  if(rc!=SQLITE_OK) throw ERROR("MySQL bind double failed, query: ") << sql() << ", " << sqlerror();
+  return 0;
+};
+
+int Query::bindblob(const string& p) {
+  int rc = sqlite3_bind_blob(pStmt, ++ref, p.data(), p.size(), SQLITE_TRANSIENT);
+  if(rc!=SQLITE_OK) throw ERROR("MySQL bind blob failed, query: ") << sql() << ", " << sqlerror();
+  return 0;
+};
+
 int Query::step() {
   if(!pStmt) throw ERROR("Query statement not prepared");
   if(g_query) print(std::cout);
@@ -146,6 +162,30 @@ const string Query::execstr() {
   return retval;
 }
 
+// fetch the next row of a query, returns 1 if a row is available, 0 when done
+int Query::next() {
+  if(!pStmt) throw ERROR("Query statement not prepared");
+  int rc = sqlite3_step(pStmt);
+  if(rc==SQLITE_ROW) return 1;
+  if(rc==SQLITE_DONE) { reset(); return 0; }
+  throw ERROR("executing SQL statement ") << sql() << ", " << sqlerror();
+}
+
+sql_int Query::getint(int col)  { return sqlite3_column_int64(pStmt, col); }
+double  Query::getfloat(int col) { return sqlite3_column_double(pStmt, col); }
+bool    Query::isnull(int col)   { return sqlite3_column_type(pStmt, col) == SQLITE_NULL; }
+
+const string Query::getstr(int col) {
+  const unsigned char * pText = sqlite3_column_text(pStmt, col);
+  return pText ? (const char*)pText : "";
+}
+
+const string Query::getblob(int col) {
+  const char* pBlob = (const char*)sqlite3_column_blob(pStmt, col);
+  int bytes = sqlite3_column_bytes(pStmt, col);
+  return pBlob ? string(pBlob, bytes) : string();
+}
+
 // Generate a report to os. Requires an IntArray containing the tab stops.
 void Query::report(std::ostream& os, const IntArray& tabs) {
   char separator = ' ';
@@ -190,6 +230,25 @@ void Query::report(std::ostream& os, const IntArray& tabs) {
   sqlite3_reset(pStmt);
 }
 
+// Generate CSV output to os, first line has the column names
+void Query::csv(std::ostream& os) {
+  if(g_query) { print(std::cout); std::cout << std::endl; }
+  int cols = sqlite3_column_count(pStmt);
+  for(int i=0;i<cols;i++) os << sqlite3_column_name(pStmt,i) << (i<cols-1 ? "," : "\n");
+  while(sqlite3_step(pStmt)==SQLITE_ROW) {
+    for(int i=0;i<cols;i++) {
+      switch(sqlite3_column_type(pStmt,i)) {
+        case SQLITE_INTEGER: os << sqlite3_column_int64(pStmt,i) ; break;
+        case SQLITE_FLOAT:   os << std::setprecision(4) << std::fixed << sqlite3_column_double(pStmt,i); break;
+        case SQLITE_TEXT:    os << '"' << sqlite3_column_text(pStmt,i) << '"'; break;
+        default:             break; // empty field for NULL and blobs
+      }
+      os << (i<cols-1 ? "," : "\n");
+    }
+  }
+  sqlite3_reset(pStmt);
+}
+
 // Print the query (with expanded bind variables)
 void Query::print(std::ostream& os) {
   os << sqlite3_expanded_sql(pStmt);
@@ -226,6 +285,7 @@ int Database::createdb(const string& fn, const char* schema) {
 
   rc = sqlite3_exec(newdb, schema, 0, 0, &errmsg);
   if( rc != SQLITE_OK ) throw ERROR("Creating schema failed on ") << fn << ", " << sqlite3_errmsg(newdb);
+  sqlite3_close(newdb);
   return 0;
 }
 
@@ -352,8 +412,9 @@ CREATE TABLE IF NOT EXISTS metadata(lock char(1) not null default 1
 , blksz integer
 , compression text
 ,constraint pk_t1 primary key(lock), constraint ck_t1_l check (lock=1));
-CREATE TABLE IF NOT EXISTS files(id integer primary key autoincrement, name TEXT, hostname TEXT, timestamp integer, blocks integer, bytes integer);
-CREATE TABLE IF NOT EXISTS staging(id integer primary key autoincrement, hash integer, bytes integer);
+CREATE TABLE IF NOT EXISTS files(id integer primary key autoincrement, name TEXT, hostname TEXT, timestamp integer, blocks integer, bytes integer, sketch blob, zero integer, sampled integer, cbytes integer, dupes integer, tag integer, unalloc integer, similar integer, dsampled integer, dbytes integer, dcbytes integer);
+CREATE TABLE IF NOT EXISTS staging(id integer primary key autoincrement, hash integer, bytes integer, tags integer default 0);
+CREATE TABLE IF NOT EXISTS extents(file integer, offset integer, size integer, blocks integer, zero integer, sampled integer, cbytes integer, hashed integer, seen integer, primary key(file, offset));
 CREATE VIEW IF NOT EXISTS offsets as with m(b) as (select blksz from metadata) select hash, printf('%0#16x',hash) hexhash, (id-1) offset, (id-1) * m.b*1024 bytes from staging,m
 )");
   StagingDB newdb(fn);
@@ -361,7 +422,7 @@ CREATE VIEW IF NOT EXISTS offsets as with m(b) as (select blksz from metadata) s
 }
 
 StagingDB::StagingDB(const string& fn): Database(fn),
-  q_insert (*this,"insert into staging(hash,bytes) values (?,?)")
+  q_insert (*this,"insert into staging(hash,bytes,tags) values (?,?,?)")
 {
   sql("PRAGMA schema_version");      // trigger error if not open
   sql("PRAGMA journal_mode = off");  // speed up, don't care about consistency
@@ -386,11 +447,12 @@ void StagingDB::setblocksize(sql_int p) {
   q.exec();
 }
 
-// insert hash, compressed bytes into staging
-void StagingDB::insertdata(uint64 hash, uint64 bytes) {
+// insert hash, compressed bytes and tag bitmask into staging
+void StagingDB::insertdata(uint64 hash, uint64 bytes, sql_int tags) {
   q_insert.bind(hash);
   if(bytes!=-1) q_insert.bind(bytes);
   else q_insert.bind(); // NULL for blocks without bytes value (-1)
+  q_insert.bind(tags);
   q_insert.exec();
 } 
 
@@ -403,7 +465,7 @@ SELECT 1+ABS(RANDOM()%0xFFFFFFFFFFFFFF), 1+ABS(RANDOM())%?2 UNION ALL
 SELECT 1+ABS(RANDOM()%0xFFFFFFFFFFFFFF), 1+ABS(RANDOM())%?2 FROM rnd LIMIT ?1
 ),
 c(x) AS (SELECT 0 UNION ALL SELECT X+1 FROM C LIMIT ?3)
-INSERT INTO STAGING SELECT NULL, K,B FROM rnd,c;
+INSERT INTO STAGING(id,hash,bytes) SELECT NULL, K,B FROM rnd,c;
 )");
   begin();
   q << rows;
@@ -421,7 +483,7 @@ with recursive
 rnd(k,b) AS (
 SELECT 0, 0 UNION ALL
 SELECT 0, 0 FROM rnd LIMIT ?1
-) INSERT INTO STAGING SELECT NULL, K,B FROM rnd;
+) INSERT INTO STAGING(id,hash,bytes) SELECT NULL, K,B FROM rnd;
 )");
   begin();
   q << rows;
@@ -430,12 +492,313 @@ SELECT 0, 0 FROM rnd LIMIT ?1
   return 0;
 }
 
-// insert file metadata
-int StagingDB::insertmeta(const string& name, sql_int blocks, sql_int bytes) {
-  Query q(*this,"insert into files (name,blocks,hostname,timestamp,bytes) values (?,?,?,?,?)");
+// insert file metadata, returns the file id. tag = 0 for untagged files
+sql_int StagingDB::insertmeta(const string& name, sql_int blocks, sql_int bytes, const string& sketch, sql_int tag) {
+  Query q(*this,"insert into files (name,blocks,hostname,timestamp,bytes,sketch,tag) values (?,?,?,?,?,?,?)");
   q << name << blocks << hostName() << sql_int(starttime) << bytes;
+  q.bindblob(sketch);
+  if(tag) q.bind(tag);
+  else q.bind();
+  q.exec();
+  return sqlite3_last_insert_rowid(db);
+}
+
+// insert scan statistics of one extent, offset and size in MiB
+void StagingDB::insertextent(sql_int file, sql_int offset, sql_int size, const ExtentStats& e) {
+  Query q(*this,"insert into extents values (?,?,?,?,?,?,?,?,?)");
+  q << file << offset << size << e.blocks << e.zero << e.sampled << e.cbytes << e.hashed << e.seen;
+  q.exec();
+}
+
+// per-file zero, compression sample and (estimated) intra-file duplicate counts
+void StagingDB::setfilestats(sql_int id, sql_int zero, sql_int sampled, sql_int cbytes, sql_int dupes, sql_int unalloc) {
+  Query q(*this,"update files set zero=?, sampled=?, cbytes=?, dupes=?, unalloc=? where id=?");
+  q << zero << sampled << cbytes << dupes << unalloc << id;
+  q.exec();
+}
+
+void StagingDB::setdeltastats(sql_int id, sql_int similar, sql_int sampled, sql_int dbytes, sql_int cbytes) {
+  Query q(*this,"update files set similar=?, dsampled=?, dbytes=?, dcbytes=? where id=?");
+  q << similar << sampled << dbytes << cbytes << id;
   q.exec();
-  return 0;
+}
+
+/*******************************************************************************
+ * Virtual tables - expose in-memory or packed data as SQLite tables
+ *
+ * sketches(file, hash): the hashes in the per-file bottom-k sketches, unpacked
+ * from the files.sketch blobs on the fly. Eponymous, i.e. no need to create it:
+ * select a.file, b.file, count(*) from sketches a join sketches b using(hash) ...
+ * Reads the (unqualified) files table, i.e. includes staging after live().
+ ******************************************************************************/
+
+struct SketchTab {
+  sqlite3_vtab base; // must be first
+  sqlite3*     db;
+};
+
+struct SketchCursor {
+  sqlite3_vtab_cursor    base;  // must be first
+  Query*                 files; // query on the files table
+  std::vector<uint64>    hashes;// hashes of the current file
+  size_t                 pos;   // position in hashes
+  sql_int                file;  // current file id
+  bool                   eof;
+};
+
+static int sketchConnect(sqlite3* db, void* pAux, int argc, const char* const* argv, sqlite3_vtab** ppVtab, char** pzErr) {
+  int rc = sqlite3_declare_vtab(db, "create table x(file integer, hash integer)");
+  if(rc!=SQLITE_OK) return rc;
+  SketchTab* p = new SketchTab();
+  p->db = db;
+  *ppVtab = &p->base;
+  return SQLITE_OK;
+}
+
+static int sketchDisconnect(sqlite3_vtab* pVtab) { delete (SketchTab*)pVtab; return SQLITE_OK; }
+
+// use an equality constraint on file if there is one
+static int sketchBestIndex(sqlite3_vtab* pVtab, sqlite3_index_info* pInfo) {
+  pInfo->idxNum = 0;
+  pInfo->estimatedCost = 1000000;
+  for(int i=0; i<pInfo->nConstraint; i++) {
+    if(pInfo->aConstraint[i].iColumn==0 && pInfo->aConstraint[i].usable && pInfo->aConstraint[i].op==SQLITE_INDEX_CONSTRAINT_EQ) {
+      pInfo->idxNum = 1;
+      pInfo->aConstraintUsage[i].argvIndex = 1;
+      pInfo->aConstraintUsage[i].omit = 1;
+      pInfo->estimatedCost = 1000;
+      break;
+    }
+  }
+  return SQLITE_OK;
+}
+
+static int sketchOpen(sqlite3_vtab* pVtab, sqlite3_vtab_cursor** ppCursor) {
+  SketchCursor* c = new SketchCursor();
+  c->files = NULL;
+  c->eof = true;
+  *ppCursor = &c->base;
+  return SQLITE_OK;
+}
+
+static int sketchClose(sqlite3_vtab_cursor* cur) {
+  SketchCursor* c = (SketchCursor*)cur;
+  delete c->files;
+  delete c;
+  return SQLITE_OK;
+}
+
+// load the next file with a non-empty sketch
+static void sketchNextFile(SketchCursor* c) {
+  c->hashes.clear();
+  c->pos = 0;
+  while(c->hashes.empty()) {
+    if(!c->files->next()) { c->eof = true; return; }
+    BottomK sketch;
+    sketch.load(c->files->getblob(1));
+    c->file = c->files->getint(0);
+    c->hashes.assign(sketch.gethashes().begin(), sketch.gethashes().end());
+  }
+  c->eof = false;
+}
+
+static int sketchFilter(sqlite3_vtab_cursor* cur, int idxNum, const char* idxStr, int argc, sqlite3_value** argv) {
+  SketchCursor* c = (SketchCursor*)cur;
+  SketchTab* t = (SketchTab*)cur->pVtab;
+  delete c->files;
+  try {
+    if(idxNum==1) {
+      c->files = new Query(t->db, "select id, sketch from files where id=?");
+      c->files->bind(sqlite3_value_int64(argv[0]));
+    }
+    else c->files = new Query(t->db, "select id, sketch from files order by id");
+    sketchNextFile(c);
+  }
+  catch (Fatal& e) { delete c->files; c->files = NULL; return SQLITE_ERROR; }
+  return SQLITE_OK;
+}
+
+static int sketchNext(sqlite3_vtab_cursor* cur) {
+  SketchCursor* c = (SketchCursor*)cur;
+  if(++c->pos < c->hashes.size()) return SQLITE_OK;
+  try { sketchNextFile(c); }
+  catch (Fatal& e) { return SQLITE_ERROR; }
+  return SQLITE_OK;
+}
+
+static int sketchEof(sqlite3_vtab_cursor* cur) { return ((SketchCursor*)cur)->eof; }
+
+static int sketchColumn(sqlite3_vtab_cursor* cur, sqlite3_context* ctx, int i) {
+  SketchCursor* c = (SketchCursor*)cur;
+  if(i==0) sqlite3_result_int64(ctx, c->file);
+  else     sqlite3_result_int64(ctx, c->hashes[c->pos]);
+  return SQLITE_OK;
+}
+
+static int sketchRowid(sqlite3_vtab_cursor* cur, sqlite3_int64* pRowid) {
+  SketchCursor* c = (SketchCursor*)cur;
+  *pRowid = c->file * ksketch_size + c->pos;
+  return SQLITE_OK;
+}
+
+static sqlite3_module sketchModule = {
+  0,                // iVersion
+  0,                // xCreate - eponymous only
+  sketchConnect, sketchBestIndex, sketchDisconnect, 0,
+  sketchOpen, sketchClose, sketchFilter, sketchNext, sketchEof, sketchColumn, sketchRowid,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+/*******************************************************************************
+ * kv_live(hash, blocks, bytes, tags): main.kv combined with the unmerged
+ * results in schema 'staging' (if attached), i.e. what kv would look like
+ * after the merge. Streams both in hash order so no temp b-tree is needed.
+ * Eponymous, see QddaDB::live() for the views that use it.
+ ******************************************************************************/
+
+struct KvRow {
+  sql_int hash, blocks, bytes, tags;
+  bool    nobytes; // bytes is NULL
+  bool    valid;   // row available
+};
+
+struct KvCursor {
+  sqlite3_vtab_cursor    base;    // must be first
+  Query*                 kv;      // main.kv in hash order
+  Query*                 staging; // staging.staging grouped by hash, NULL if not attached
+  KvRow                  a, b;    // next row of each
+  KvRow                  row;     // current (combined) row
+  sql_int                rowid;
+  bool                   eof;
+};
+
+static int kvConnect(sqlite3* db, void* pAux, int argc, const char* const* argv, sqlite3_vtab** ppVtab, char** pzErr) {
+  int rc = sqlite3_declare_vtab(db, "create table x(hash integer, blocks integer, bytes integer, tags integer)");
+  if(rc!=SQLITE_OK) return rc;
+  SketchTab* p = new SketchTab();
+  p->db = db;
+  *ppVtab = &p->base;
+  return SQLITE_OK;
+}
+
+// rows come in hash order, tell sqlite so it can skip sorting
+static int kvBestIndex(sqlite3_vtab* pVtab, sqlite3_index_info* pInfo) {
+  pInfo->estimatedCost = 1000000;
+  if(pInfo->nOrderBy==1 && pInfo->aOrderBy[0].iColumn==0 && !pInfo->aOrderBy[0].desc) pInfo->orderByConsumed = 1;
+  return SQLITE_OK;
+}
+
+static int kvOpen(sqlite3_vtab* pVtab, sqlite3_vtab_cursor** ppCursor) {
+  KvCursor* c = new KvCursor();
+  c->kv = NULL;
+  c->staging = NULL;
+  c->eof = true;
+  *ppCursor = &c->base;
+  return SQLITE_OK;
+}
+
+static void kvFree(KvCursor* c) {
+  delete c->kv;
+  delete c->staging;
+  c->kv = c->staging = NULL;
+}
+
+static int kvClose(sqlite3_vtab_cursor* cur) {
+  KvCursor* c = (KvCursor*)cur;
+  kvFree(c);
+  delete c;
+  return SQLITE_OK;
+}
+
+static void kvFetch(Query* q, KvRow& r) {
+  r.valid = q && q->next();
+  if(!r.valid) return;
+  r.hash    = q->getint(0);
+  r.blocks  = q->getint(1);
+  r.nobytes = q->isnull(2);
+  r.bytes   = q->getint(2);
+  r.tags    = q->getint(3);
+}
+
+// next row is the lowest hash of both, combined as in QddaDB::merge if equal
+static void kvNextRow(KvCursor* c) {
+  if(!c->a.valid && !c->b.valid) { c->eof = true; return; }
+  if(!c->b.valid || (c->a.valid && c->a.hash < c->b.hash)) { c->row = c->a; kvFetch(c->kv, c->a); }
+  else if(!c->a.valid || c->b.hash < c->a.hash)            { c->row = c->b; kvFetch(c->staging, c->b); }
+  else {
+    c->row = c->a;
+    c->row.blocks += c->b.blocks;
+    c->row.tags   |= c->b.tags;
+    if(c->row.nobytes) { c->row.bytes = c->b.bytes; c->row.nobytes = c->b.nobytes; }
+    kvFetch(c->kv, c->a);
+    kvFetch(c->staging, c->b);
+  }
+  c->rowid++;
+  c->eof = false;
+}
+
+static int kvFilter(sqlite3_vtab_cursor* cur, int idxNum, const char* idxStr, int argc, sqlite3_value** argv) {
+  KvCursor* c = (KvCursor*)cur;
+  SketchTab* t = (SketchTab*)cur->pVtab;
+  kvFree(c);
+  try {
+    c->kv = new Query(t->db, "select hash, blocks, bytes, tags from main.kv order by hash");
+    Query q_att(t->db, "select count(*) from pragma_database_list where name='staging'");
+    if(q_att.next() && q_att.getint(0))
+      c->staging = new Query(t->db, "select hash, count(*), max(bytes), bitor(tags) from staging.staging group by hash order by hash");
+    kvFetch(c->kv, c->a);
+    kvFetch(c->staging, c->b);
+    c->rowid = 0;
+    kvNextRow(c);
+  }
+  catch (Fatal& e) { kvFree(c); c->eof = true; return SQLITE_ERROR; }
+  return SQLITE_OK;
+}
+
+static int kvNext(sqlite3_vtab_cursor* cur) {
+  try { kvNextRow((KvCursor*)cur); }
+  catch (Fatal& e) { return SQLITE_ERROR; }
+  return SQLITE_OK;
+}
+
+static int kvEof(sqlite3_vtab_cursor* cur) { return ((KvCursor*)cur)->eof; }
+
+static int kvColumn(sqlite3_vtab_cursor* cur, sqlite3_context* ctx, int i) {
+  const KvRow& r = ((KvCursor*)cur)->row;
+  switch(i) {
+    case 0: sqlite3_result_int64(ctx, r.hash); break;
+    case 1: sqlite3_result_int64(ctx, r.blocks); break;
+    case 2: if(r.nobytes) sqlite3_result_null(ctx); else sqlite3_result_int64(ctx, r.bytes); break;
+    case 3: sqlite3_result_int64(ctx, r.tags); break;
+  }
+  return SQLITE_OK;
+}
+
+static int kvRowid(sqlite3_vtab_cursor* cur, sqlite3_int64* pRowid) {
+  *pRowid = ((KvCursor*)cur)->rowid;
+  return SQLITE_OK;
+}
+
+static sqlite3_module kvModule = {
+  0,                // iVersion
+  0,                // xCreate - eponymous only
+  kvConnect, kvBestIndex, sketchDisconnect, 0,
+  kvOpen, kvClose, kvFilter, kvNext, kvEof, kvColumn, kvRowid,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+/*******************************************************************************
+ * bitor(x) aggregate - bitwise or of all values, used to merge tag bitmasks
+ ******************************************************************************/
+
+static void bitorStep(sqlite3_context* ctx, int argc, sqlite3_value** argv) {
+  sql_int* p = (sql_int*)sqlite3_aggregate_context(ctx, sizeof(sql_int));
+  if(p) *p |= sqlite3_value_int64(argv[0]);
+}
+
+static void bitorFinal(sqlite3_context* ctx) {
+  sql_int* p = (sql_int*)sqlite3_aggregate_context(ctx, 0);
+  sqlite3_result_int64(ctx, p ? *p : 0);
 }
 
 /*******************************************************************************
@@ -448,6 +811,10 @@ QddaDB::QddaDB(const string& fn): Database(fn) {
   // sql("PRAGMA temp_store = 2"); // use memory for temp tables
   sql("PRAGMA journal_mode = off");  // speed up, don't care about consistency
   sql("PRAGMA synchronous = off");   // same
+  sqlite3_create_module(db, "sketches", &sketchModule, NULL);
+  sqlite3_create_module(db, "kv_live",  &kvModule, NULL);
+  sqlite3_create_function(db, "bitor", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL, NULL, bitorStep, bitorFinal);
+  upgrade();
 }
 
 void    QddaDB::squash()       { sql("update kv set blocks=1"); update(); }
@@ -457,8 +824,8 @@ sql_int QddaDB::getrows()      { return getint("select count(*) from kv"); }
 sql_int QddaDB::getarrayid()   { return getint("select arrayid from metadata"); }
 sql_int QddaDB::getmethod()    { return getint("select method from metadata"); }
 
-void QddaDB::createdb(const string& fn) {
-  Database::createdb(fn,R"(
+// all statements must be idempotent, upgrade() runs them on existing databases
+static const char* kqdda_schema = R"(
 CREATE TABLE IF NOT EXISTS metadata(lock char(1) not null default 1
 , version text
 , blksz integer
@@ -473,18 +840,80 @@ CREATE TABLE IF NOT EXISTS files(id integer primary key autoincrement
 , hostname TEXT
 , timestamp integer
 , blocks integer
-, bytes integer);
-
-CREATE TABLE IF NOT EXISTS kv(hash unsigned integer primary key, blocks integer, bytes integer) WITHOUT ROWID;
+, bytes integer
+, sketch blob
+, zero integer
+, sampled integer
+, cbytes integer
+, dupes integer
+, tag integer
+, unalloc integer
+, similar integer
+, dsampled integer
+, dbytes integer
+, dcbytes integer);
+
+CREATE TABLE IF NOT EXISTS tags(id integer primary key, name TEXT unique not null);
+
+CREATE TABLE IF NOT EXISTS extents(file integer
+, offset integer
+, size integer
+, blocks integer
+, zero integer
+, sampled integer
+, cbytes integer
+, hashed integer
+, seen integer
+, primary key(file, offset)) WITHOUT ROWID;
+
+CREATE TABLE IF NOT EXISTS kv(hash unsigned integer primary key, blocks integer, bytes integer, tags integer) WITHOUT ROWID;
 CREATE TABLE IF NOT EXISTS buckets(bucksz integer primary key NOT NULL);
 
+CREATE TABLE IF NOT EXISTS trickle(lock char(1) not null default 1
+, signature TEXT
+, pass integer
+, round integer
+, rounds integer
+, seed integer
+, h_thin real
+, h_dedupe real
+, h_compress real
+, constraint pk_t2 primary key(lock), constraint ck_t2_l check (lock=1));
+
+CREATE TABLE IF NOT EXISTS estimates(id integer primary key
+, timestamp integer
+, pass integer
+, round integer
+, coverage real
+, thin real
+, dedupe real
+, compress real
+, r_thin real
+, r_dedupe real
+, r_compress real);
+
 CREATE VIEW IF NOT EXISTS v_files as
+with m(blksz) as (select blksz*1024 from metadata)
 select id as file
 , bytes/blocks as blksz
 , blocks, bytes/1024/1024 as MiB
+, 100.0*zero/blocks as zero
+, 100.0*dupes/blocks as dupe
+, 1.0*sampled*m.blksz/cbytes as compr
 , strftime('%Y%m%d_%H%M', timestamp, 'unixepoch', 'utc') as date
 , hostname || ':' || name as url 
-from files;
+from files,m;
+
+CREATE VIEW IF NOT EXISTS v_extents as
+with m(blksz) as (select blksz*1024 from metadata)
+select file
+, offset
+, size
+, blocks
+, 100.0*zero/blocks as zero
+, 100.0*seen/hashed as dupe
+, 1.0*sampled*m.blksz/cbytes as compr
+from extents,m order by file, offset;
 
 CREATE VIEW IF NOT EXISTS v_sums_deduped as
 select blocks ref, count(blocks) blocks
@@ -497,8 +926,8 @@ select ((bytes-1)/1024)+1 size,count(*) blocks
 , sum(bytes*blocks) raw
 from kv where hash!=0 and bytes not NULL group by (bytes-1)/1024;
 
-CREATE TABLE m_sums_deduped as select * from v_sums_deduped where 1=0;
-CREATE TABLE m_sums_compressed as select * from v_sums_compressed where 1=0;
+CREATE TABLE IF NOT EXISTS m_sums_deduped as select * from v_sums_deduped where 1=0;
+CREATE TABLE IF NOT EXISTS m_sums_compressed as select * from v_sums_compressed where 1=0;
 
 CREATE VIEW IF NOT EXISTS v_bucket_compressed as
 WITH data(blksz,total) as (select (select max(bucksz) from buckets),(select sum(blocks) from m_sums_compressed))
@@ -527,7 +956,44 @@ WITH temp(size, blksz, buckets, blocks, perc) as (
 select size, blksz, blocks, (size*blocks+blksz-1)/blksz, 100.0*blocks/total
 from v_bucket_compressed)
 select size, buckets, buckets*blksz/1024.0 RawMiB, perc, blocks, blocks*blksz/1024.0 MiB from temp;
-)");
+)";
+
+void QddaDB::createdb(const string& fn) {
+  Database::createdb(fn, kqdda_schema);
+}
+
+// columns added after the first release, NULL in existing rows
+static const char* kqdda_columns[][3] = {
+  { "files", "sketch",   "blob"    },
+  { "files", "zero",     "integer" },
+  { "files", "sampled",  "integer" },
+  { "files", "cbytes",   "integer" },
+  { "files", "dupes",    "integer" },
+  { "files", "tag",      "integer" },
+  { "files", "unalloc",  "integer" },
+  { "files", "similar",  "integer" },
+  { "files", "dsampled", "integer" },
+  { "files", "dbytes",   "integer" },
+  { "files", "dcbytes",  "integer" },
+  { "kv",    "tags",     "integer" }
+};
+
+// bring a database created by an older version up to date: missing columns,
+// new tables and views. v_files is recreated because it uses the new columns
+void QddaDB::upgrade() {
+  Query q_column(*this, "select count(*) from pragma_table_info(?) where name=?");
+  bool changed = false;
+  for(size_t i=0; i<sizeof(kqdda_columns)/sizeof(kqdda_columns[0]); i++) {
+    q_column << kqdda_columns[i][0] << kqdda_columns[i][1];
+    if(q_column.execi()) continue;
+    if(!changed) begin();
+    changed = true;
+    sql(string("alter table ") + kqdda_columns[i][0] + " add column " + kqdda_columns[i][1] + " " + kqdda_columns[i][2]);
+  }
+  if(!changed) return;
+  sql("drop view if exists v_files");
+  sql(kqdda_schema);
+  end();
 }
 
 /*******************************************************************************
@@ -560,6 +1026,28 @@ void QddaDB::loadbuckets(const IntArray& v) {
   };
 }
 
+// id of a tag (group) name, new tags are added. Ids are limited to 63 because
+// kv.tags keeps one bit per tag
+sql_int QddaDB::gettag(const string& name) {
+  Query q_find(*this,"select id from tags where name=?");
+  q_find << name;
+  sql_int id = q_find.execi();
+  if(id) return id;
+  id = getint("select coalesce(max(id),0)+1 from tags");
+  if(id > ktags_max) throw ERROR("Too many tags (max ") << ktags_max << "), cannot add " << name;
+  Query q_add(*this,"insert into tags(id,name) values (?,?)");
+  q_add << id << name;
+  q_add.exec();
+  return id;
+}
+
+// bucket sizes (KiB) in ascending order, without the 0 bucket
+void QddaDB::getbuckets(IntArray& v) {
+  Query q(*this,"select bucksz from buckets where bucksz>0 order by bucksz");
+  v.clear();
+  while(q.next()) v << q.getint(0);
+}
+
 /*
 for reference, classic merge:
 insert or replace into kv
@@ -571,19 +1059,54 @@ group by tmpdb.staging.k
 // merge staging data into main table (performance optimized)
 void  QddaDB::merge(const string& name) {
   attach("tmpdb",name);
-  Query q_merge(db,"with t(hash,blocks,bytes) as ("
-                   "select hash,blocks,bytes from kv union all "
-                   "select hash,1,bytes from tmpdb.staging"
+  Query q_merge(db,"with t(hash,blocks,bytes,tags) as ("
+                   "select hash,blocks,bytes,tags from kv union all "
+                   "select hash,1,bytes,tags from tmpdb.staging"
                    ") insert or replace into kv "
-                   "select hash,sum(blocks),bytes from t group by hash"); //  order by hash
-  Query q_copy(db, "insert into files (name,hostname,timestamp,blocks,bytes) "
-                   "select name,hostname,timestamp,blocks,bytes from tmpdb.files");
+                   "select hash,sum(blocks),bytes,bitor(tags) from t group by hash"); //  order by hash
+  // file ids in the staging db are renumbered after the existing ones
+  Query q_extents(db, "insert into extents select file + (select coalesce(max(id),0) from main.files)"
+                      ",offset,size,blocks,zero,sampled,cbytes,hashed,seen from tmpdb.extents");
+  Query q_copy(db, "insert into files (id,name,hostname,timestamp,blocks,bytes,sketch,zero,sampled,cbytes,dupes,tag,unalloc,similar,dsampled,dbytes,dcbytes) "
+                   "select id + (select coalesce(max(id),0) from main.files)"
+                   ",name,hostname,timestamp,blocks,bytes,sketch,zero,sampled,cbytes,dupes,tag,unalloc,similar,dsampled,dbytes,dcbytes from tmpdb.files order by id");
   q_merge.exec();
+  q_extents.exec();
   q_copy.exec();
   detach("tmpdb");
   update();
 }
 
+// attach an unmerged staging db and shadow kv, files, extents and all views with
+// temp views that include it, so (unqualified) queries see the results as if
+// merged. The main.* tables are unchanged
+void QddaDB::live(const string& name) {
+  attach("staging", name);
+  sql("CREATE TEMP VIEW kv as select hash, blocks, bytes, tags from kv_live;\n"
+      "CREATE TEMP VIEW files as select * from main.files union all "
+      "select id + (select coalesce(max(id),0) from main.files)"
+      ",name,hostname,timestamp,blocks,bytes,sketch,zero,sampled,cbytes,dupes,tag,unalloc,similar,dsampled,dbytes,dcbytes from staging.files;\n"
+      "CREATE TEMP VIEW extents as select * from main.extents union all "
+      "select file + (select coalesce(max(id),0) from main.files)"
+      ",offset,size,blocks,zero,sampled,cbytes,hashed,seen from staging.extents;\n");
+  // views in main resolve names in main, so they need a temp copy
+  Query q_views(db, "select sql from main.sqlite_master where type='view'");
+  while(q_views.next()) {
+    string s = q_views.getstr(0);
+    if(s.compare(0, 11, "CREATE VIEW") == 0) sql("CREATE TEMP VIEW" + s.substr(11));
+  }
+  sql("CREATE TEMP VIEW m_sums_deduped as select * from temp.v_sums_deduped;\n"
+      "CREATE TEMP VIEW m_sums_compressed as select * from temp.v_sums_compressed;\n");
+}
+
+// delete scan results (kv, files, extents), keeps metadata, tags and trickle estimates
+void QddaDB::clear() {
+  sql("delete from kv;\n"
+      "delete from files;\n"
+      "delete from extents;\n");
+  update();
+}
+
 // update results tables
 void QddaDB::update() {
   sql("delete from m_sums_compressed;\n"
@@ -594,16 +1117,40 @@ void QddaDB::update() {
 
 // import another database      
 void QddaDB::import(const string& fn) {
+  { QddaDB upgrade(fn); } // add missing columns and tables if it is from an older version
   attach("impdb",fn);
+
+  // tags are matched by name, ids (and kv.tags bits) are renumbered to the ones in main
+  // (databases from older versions have no tags)
+  std::vector<std::pair<sql_int,string>> imptags;
+  if(getint("select count(*) from impdb.sqlite_master where type='table' and name='tags'")) {
+    Query q_tags(db,"select id, name from impdb.tags order by id");
+    while(q_tags.next()) imptags.push_back(std::make_pair(q_tags.getint(0), q_tags.getstr(1)));
+  }
+  std::stringstream tagmask, tagid;
+  tagmask << "0";
+  for(size_t i=0; i<imptags.size(); i++) {
+    sql_int id = gettag(imptags[i].second);
+    tagmask << " | (((coalesce(impdb.kv.tags,0) >> " << imptags[i].first-1 << ") & 1) << " << id-1 << ")";
+    tagid   << " when " << imptags[i].first << " then " << id;
+  }
+  string tagexpr = imptags.empty() ? "NULL" : "case tag" + tagid.str() + " end";
+
   sql("insert or replace into main.kv \n"
       "select impdb.kv.hash \n"
       ", coalesce(main.kv.blocks,0) + impdb.kv.blocks\n"
-      ", impdb.kv.bytes from impdb.kv\n"
+      ", impdb.kv.bytes\n"
+      ", coalesce(main.kv.tags,0) | " + tagmask.str() + "\n"
+      "from impdb.kv\n"
       "left outer join main.kv on main.kv.hash = impdb.kv.hash\n"
       "group by impdb.kv.hash\n"
       "order by main.kv.hash,impdb.kv.hash\n");
-  sql("insert into files(name, hostname, timestamp, blocks, bytes) "
-      "select name, hostname, timestamp, blocks, bytes from impdb.files");
+  sql("insert into extents select file + (select coalesce(max(id),0) from main.files)"
+      ", offset, size, blocks, zero, sampled, cbytes, hashed, seen from impdb.extents");
+  sql("insert into files(id, name, hostname, timestamp, blocks, bytes, sketch, zero, sampled, cbytes, dupes, tag, unalloc, similar, dsampled, dbytes, dcbytes) "
+      "select id + (select coalesce(max(id),0) from main.files)"
+      ", name, hostname, timestamp, blocks, bytes, sketch, zero, sampled, cbytes, dupes, " + tagexpr + ", unalloc, similar, dsampled, dbytes, dcbytes\n"
+      "from impdb.files order by id");
   update();
   detach("impdb");
 }
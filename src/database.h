@@ -22,6 +22,8 @@ class Database;
 
 typedef sqlite3_int64 sql_int; // shorthand
 
+const int ktags_max = 63; // max number of tags (file groups), one bit each in kv.tags
+
 /*******************************************************************************
  * Query class
  * hold a prepared SQLite query. Automatically finalized by destructor
@@ -39,17 +41,26 @@ public:
   int   bind(const char*);             // same for char*
   int   bind(const std::string&);      // same for string
   int   bind();                        // bind NULL
+  int   bindblob(const std::string&);  // bind string contents as blob
+  int   bindf(double);                 // bind floating point (no overload to keep bind(int) unambiguous)
   void  exec();                        // execute query, ignore results
   sql_int execi();                     // execute query, return sql int
   sql_int execi(sql_int p);            // same but bind parameter first
   sql_int execi(sql_int p,sql_int q);  // 2 parameters
   double execf();                      // execute query, return double
   const std::string execstr();         // return string result
+  int   next();                        // fetch next row, returns 0 if no more rows
+  sql_int getint(int col);             // int value of column in current row
+  double getfloat(int col);            // same for double
+  const std::string getstr(int col);   // same for string
+  const std::string getblob(int col);  // same for blob
+  bool  isnull(int col);               // true if column in current row is NULL
   const char * sqlerror();             // show error message
   Query& operator<< (sql_int);         // bind operators, ostream style
   Query& operator<< (const char *);
   Query& operator<< (const std::string&);
   void  report(std::ostream& os, const IntArray& tabs); // run a query as report
+  void  csv(std::ostream& os);         // run a query, output as CSV with header
 private:
   void init(sqlite3* db, const char*); // shared constructor due to C++03
   Query(const Query&);                 // disable copy i.e. auto = (Query)
@@ -97,6 +108,19 @@ private:
   friend class Query;
 };
 
+/*******************************************************************************
+ * ExtentStats struct - scan statistics for a range (extent) of a file
+ ******************************************************************************/
+
+struct ExtentStats {
+  sql_int blocks;  // blocks processed
+  sql_int zero;    // zero blocks
+  sql_int sampled; // non-zero blocks sampled for compression
+  sql_int cbytes;  // compressed bytes of sampled blocks
+  sql_int hashed;  // non-zero blocks in the hash sample for dedupe
+  sql_int seen;    // blocks in the hash sample seen earlier in the scan
+};
+
 /*******************************************************************************
  * StagingDB class - Staging database for qdda
  ******************************************************************************/
@@ -107,8 +131,11 @@ public:
   static void createdb(const std::string& fn, int64 blocksize);
   int         fillrandom(sql_int rows, int blocksize, int dup);
   int         fillzero(sql_int rows);
-  void        insertdata(uint64, uint64);
-  int         insertmeta(const std::string& name, sql_int blocks, sql_int bytes);
+  void        insertdata(uint64 hash, uint64 bytes, sql_int tags = 0);
+  sql_int     insertmeta(const std::string& name, sql_int blocks, sql_int bytes, const std::string& sketch, sql_int tag = 0);
+  void        setfilestats(sql_int id, sql_int zero, sql_int sampled, sql_int cbytes, sql_int dupes, sql_int unalloc = 0);
+  void        setdeltastats(sql_int id, sql_int similar, sql_int sampled, sql_int dbytes, sql_int cbytes);
+  void        insertextent(sql_int file, sql_int offset, sql_int size, const ExtentStats&);
   sql_int blocksize();
   sql_int getrows();
   void  setblocksize(sql_int);
@@ -124,13 +151,18 @@ public:
   explicit QddaDB(const std::string& fn);
   static void  createdb(const std::string& fn);
   void  loadbuckets(const IntArray& buckets);
+  void  getbuckets(IntArray& buckets);
+  sql_int gettag(const std::string& name);
   void  import(const std::string&);
   void  merge(const std::string&);
+  void  live(const std::string&);
   int   insbucket(const char *,int64, int64);
   void  set_comp_method();
   void  setmetadata(sql_int blocksz, sql_int method, sql_int interval, sql_int array, const IntArray& buckets);
 
   void  update();
+  void  upgrade();
+  void  clear();
   void  copymeta();
   void  squash();
 
@@ -0,0 +1,147 @@
+/*******************************************************************************
+ * Title       : delta.cpp
+ * Description : Near-duplicate (similar) block detection for qdda --delta
+ * Author      : Bart Sjerps <bart@dirty-cache.com>
+ * License     : GPLv3+
+ * Disclaimer  : See https://www.gnu.org/licenses/gpl-3.0.txt
+ * More info   : https://wiki.dirty-cache.com/qdda
+ ******************************************************************************/
+
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+
+#include "lz4/lz4.h"
+#include "error.h"
+#include "tools.h"
+#include "delta.h"
+
+const uint64 kdelta_anchor  = 0xF800000000000000ULL; // top 5 bits zero = anchor, 1 in 32 positions
+const int64  kdelta_store   = 32 * 1048576;          // memory for sampled references
+
+// splitmix64 - deterministic pseudo random numbers and a strong 64-bit mix
+static uint64 mix64(uint64 x) {
+  x += 0x9E3779B97F4A7C15ULL;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+// gear table and feature transforms, the same on every run so results are repeatable
+struct DeltaTables {
+  uint64 gear[256];
+  uint64 mul[kdelta_features];
+  uint64 add[kdelta_features];
+  DeltaTables() {
+    for(int i=0; i<256; i++)             gear[i] = mix64(i);
+    for(int i=0; i<kdelta_features; i++) { mul[i] = mix64(1000 + i) | 1; add[i] = mix64(2000 + i); }
+  }
+};
+
+static const DeltaTables tables;
+
+/*******************************************************************************
+ * Super-features - the rolling hash only depends on the last 64 bytes (each
+ * byte is shifted out after 64 steps) so anchors and features are the same
+ * for the same content at a different offset
+ ******************************************************************************/
+
+FeatureHash::FeatureHash() {
+  h     = 0;
+  found = false;
+  for(int f=0; f<kdelta_features; f++) feature[f] = 0;
+}
+
+void FeatureHash::update(const char* data, int size) {
+  const unsigned char* p = (const unsigned char*)data;
+  for(int i=0; i<size; i++) {
+    h = (h << 1) + tables.gear[p[i]];
+    if(h & kdelta_anchor) continue;
+    found = true;
+    for(int f=0; f<kdelta_features; f++) {
+      uint64 v = h * tables.mul[f] + tables.add[f];
+      if(v > feature[f]) feature[f] = v;
+    }
+  }
+}
+
+void FeatureHash::final(uint64* sf) {
+  const int group = kdelta_features / kdelta_sfs;
+  for(int s=0; s<kdelta_sfs; s++) {
+    uint64 v = s;
+    for(int f=0; f<group; f++) v = mix64(v ^ feature[s*group + f]);
+    sf[s] = found ? (v ? v : 1) : 0;
+  }
+}
+
+void superFeatures(const char* data, int size, uint64* sf) {
+  FeatureHash fh;
+  fh.update(data, size);
+  fh.final(sf);
+}
+
+/*******************************************************************************
+ * DeltaIndex class functions
+ ******************************************************************************/
+
+DeltaIndex::DeltaIndex(int files, int64 bytes): stats(files) {
+  blockbytes = bytes;
+  table.resize(kdelta_sfs << kdelta_bits);
+  for(size_t i=0; i<table.size(); i++) table[i].sf = table[i].ref = 0;
+  size_t nslots = std::max(kdelta_store / blockbytes, (int64)1);
+  store.resize(nslots * blockbytes);
+  storehash.assign(nslots, 0);
+  storebytes.assign(nslots, 0);
+  nextslot = 0;
+  pair.resize(2 * blockbytes);
+  cbuf.resize(LZ4_compressBound(2 * blockbytes));
+}
+
+// the block is compressed directly after its reference in one buffer so matches
+// against the reference are found (the streaming/dictionary API of the bundled
+// LZ4 1.8.2 does not find them), the delta is what it adds to the reference
+int DeltaIndex::deltasize(size_t slot, const char* data) {
+  memcpy(&pair[0], &store[slot * blockbytes], blockbytes);
+  memcpy(&pair[blockbytes], data, blockbytes);
+  int result = LZ4_compress_default(&pair[0], &cbuf[0], 2 * blockbytes, cbuf.size());
+  int delta  = (result <= 0 ? 2 * blockbytes : result) - storebytes[slot];
+  return std::max(std::min(delta, (int)blockbytes), 0);
+}
+
+void DeltaIndex::add(int file, uint64 hash, const uint64* sf, const char* data, int lz4bytes) {
+  if(hash == 0 || sf[0] == 0) return;  // zero block or no features
+  if(seen.testset(hash)) return;       // exact duplicate
+  const uint64 mask = (1ULL << kdelta_bits) - 1;
+
+  for(int s=0; s<kdelta_sfs; s++) {
+    Entry& e = table[((uint64)s << kdelta_bits) + (sf[s] & mask)];
+    if(e.sf != sf[s] || e.ref == hash) continue;
+    DeltaStats& r_stats = stats[file];
+    r_stats.similar++;
+    if(!deltaPairSample(hash)) return;
+    auto it = slots.find(e.ref);
+    if(it != slots.end()) { // reference in memory, estimate delta
+      r_stats.sampled++;
+      r_stats.cbytes += std::min(lz4bytes, (int)blockbytes);
+      r_stats.dbytes += deltasize(it->second, data);
+    }
+    return;
+  }
+
+  // new reference
+  for(int s=0; s<kdelta_sfs; s++) {
+    Entry& e = table[((uint64)s << kdelta_bits) + (sf[s] & mask)];
+    e.sf  = sf[s];
+    e.ref = hash;
+  }
+  if(!deltaRefSample(hash)) return;
+  if(storehash[nextslot]) slots.erase(storehash[nextslot]);
+  memcpy(&store[nextslot * blockbytes], data, blockbytes);
+  storehash[nextslot] = hash;
+  storebytes[nextslot] = lz4bytes;
+  slots[hash] = nextslot;
+  nextslot = (nextslot + 1) % storehash.size();
+}
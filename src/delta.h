@@ -0,0 +1,105 @@
+/*******************************************************************************
+ * Title       : delta.h
+ * Description : header file for delta.cpp - near-duplicate (similar) blocks
+ * Author      : Bart Sjerps <bart@dirty-cache.com>
+ * License     : GPLv3+, https://www.gnu.org/licenses/gpl-3.0.txt
+ * Disclaimer  : GPLv3+
+ * URL         : https://wiki.dirty-cache.com/qdda
+ ******************************************************************************/
+
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+
+#include "tools.h"
+#include "sketch.h"
+
+/*******************************************************************************
+ * Super-features - resemblance sketch of the contents of a block (--delta)
+ * A gear rolling hash runs over the block, at content-defined anchor points
+ * (1 in 32 positions) each of the kdelta_features features keeps the maximum
+ * of a different linear transform of the rolling hash. Groups of 4 features
+ * are hashed into a super-feature: blocks that share a super-feature are very
+ * likely similar (most of their contents are the same, at any offset).
+ * sf[] is all zeroes if there are no anchors (i.e. repeating patterns).
+ * FeatureHash takes the block in consecutive pieces (the tiles of BlockKernel)
+ * so the features are calculated while the data is in cache.
+ ******************************************************************************/
+
+const int kdelta_features = 12;
+const int kdelta_sfs      = 3;  // super-features per block
+
+class FeatureHash {
+public:
+  FeatureHash();
+  void update(const char* data, int size); // next piece of the block
+  void final(uint64* sf);                  // kdelta_sfs super-features
+private:
+  uint64 h;                                // gear rolling hash
+  bool   found;                            // at least one anchor
+  uint64 feature[kdelta_features];
+};
+
+void superFeatures(const char* data, int size, uint64* sf);
+
+/*******************************************************************************
+ * Delta samples - the LZ4 size of a block is only needed if it can be a
+ * sampled reference (1 in 8 by hash) or a sampled similar block (another
+ * 1 in 8 by hash). The workers calculate it for these blocks, the updater
+ * only compresses the sampled similar blocks behind their reference.
+ ******************************************************************************/
+
+const int kdelta_refmask  = 7; // 1 in 8 references kept for delta estimates
+const int kdelta_pairmask = 7; // 1 in 8 similar blocks get a delta estimate
+
+inline bool deltaRefSample(uint64 hash)  { return !((hash >> 48) & kdelta_refmask); }
+inline bool deltaPairSample(uint64 hash) { return !((hash >> 40) & kdelta_pairmask); }
+inline bool deltaSample(uint64 hash)     { return deltaRefSample(hash) || deltaPairSample(hash); }
+
+/*******************************************************************************
+ * DeltaIndex class - finds blocks similar to an earlier distinct block
+ * Only used from the updater (no locking). Per non-zero block:
+ * - exact duplicates (bloom filter on the hash) are skipped, they dedupe
+ * - the super-features are looked up in an LSH index (one direct-mapped table
+ *   per super-feature). A match with a different hash is a similar block that
+ *   an array with delta compression could store as a difference against the
+ *   earlier block (the reference). Otherwise the block becomes a reference
+ * - a sample of the references is kept in memory, sampled blocks similar to a
+ *   sampled reference are compressed with LZ4 behind the reference (reference
+ *   as 'dictionary'), the extra compressed bytes are the estimated delta size,
+ *   compared against plain LZ4 of the block (lz4bytes from the worker)
+ * The index holds 2^kdelta_bits entries per table, older references are
+ * replaced by newer ones when the table fills up.
+ ******************************************************************************/
+
+const int kdelta_bits = 20; // 3 x 16 MiB
+
+struct DeltaStats {
+  int64 similar;  // distinct blocks similar to an earlier distinct block
+  int64 sampled;  // similar blocks with delta estimate (reference in memory)
+  int64 dbytes;   // delta (LZ4 with the reference as prefix) bytes of the sampled blocks
+  int64 cbytes;   // LZ4 compressed bytes of the sampled blocks
+};
+
+class DeltaIndex {
+public:
+  DeltaIndex(int files, int64 blockbytes);
+  void add(int file, uint64 hash, const uint64* sf, const char* data, int lz4bytes);
+  const DeltaStats& getstats(int file) { return stats[file]; }
+private:
+  DeltaIndex(const DeltaIndex&) = delete;
+  int  deltasize(size_t slot, const char* data);      // LZ4 compressed size of data after the reference
+  struct Entry { uint64 sf; uint64 ref; };            // super-feature, hash of the reference block
+  std::vector<Entry>      table;                      // kdelta_sfs tables
+  BloomFilter             seen;                       // hashes seen before (exact duplicates)
+  std::vector<DeltaStats> stats;                      // per file
+  int64                   blockbytes;
+  std::vector<char>       store;                      // data of sampled references (ring)
+  std::vector<uint64>     storehash;                  // hash per store slot
+  std::vector<int>        storebytes;                 // LZ4 compressed size per store slot
+  std::unordered_map<uint64, size_t> slots;           // hash -> store slot
+  size_t                  nextslot;
+  std::vector<char>       pair;                       // reference + block
+  std::vector<char>       cbuf;                       // compression output
+};
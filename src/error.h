@@ -9,6 +9,10 @@
 
 #pragma once
 
+#include <iostream>
+#include <sstream>
+#include <exception>
+
 /*******************************************************************************
  * Exception/error handling
  * 
@@ -0,0 +1,48 @@
+/*******************************************************************************
+ * Title       : example.cpp
+ * Description : libqdda example - the usage example from libqdda.h, built with
+ *               the rest of qdda so it stays in sync with the API
+ * Author      : Bart Sjerps <bart@dirty-cache.com>
+ * License     : GPLv3+
+ * Disclaimer  : See https://www.gnu.org/licenses/gpl-3.0.txt
+ * More info   : https://wiki.dirty-cache.com/qdda
+ ******************************************************************************/
+
+#include <iostream>
+#include <vector>
+
+#include "libqdda.h"
+
+// scan a few MiB of generated data pushed from memory into /tmp/job.db
+int main() {
+  try {
+    IntArray buckets;
+    for(int i=1; i<=16; i++) if(i!=14) buckets << i;
+    std::vector<char> data(1048576);
+    for(size_t i=0; i<data.size(); i++) data[i] = (char)(i % 4096 < 2048 ? i / 4096 : 0);
+    const size_t bytes = data.size();
+
+    if(Database::exists("/tmp/job.db")) Database::deletedb("/tmp/job.db");
+
+    QddaDB::createdb("/tmp/job.db");                  // new database
+    QddaDB db("/tmp/job.db");
+    db.setmetadata(16, Metadata::lz4, 1, Metadata::x2, buckets);
+    Parameters p = {};                                // workers, buffers etc
+    p.stagingname = "/tmp/job-staging.db";
+    p.workers = 8; p.extent = 256;
+    ScanEngine engine(db, p);
+    int s = engine.addstream("backup-job-1");         // streams, sources or files
+    engine.start();
+    for(int i=0; i<4; i++)
+      engine.push(s, &data[0], bytes);                // as often as needed
+    engine.finish();                                  // wait until all is processed
+    db.merge(p.stagingname);                          // results are now in db (kv, files)
+    Database::deletedb(p.stagingname);
+    report(db);
+  }
+  catch (Fatal& e) {
+    e.print();
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,296 @@
+/*******************************************************************************
+ * Title       : fsmap.cpp
+ * Description : Filesystem free space maps (ext2/3/4, XFS) for qdda --fsaware
+ * Author      : Bart Sjerps <bart@dirty-cache.com>
+ * License     : GPLv3+
+ * Disclaimer  : See https://www.gnu.org/licenses/gpl-3.0.txt
+ * More info   : https://wiki.dirty-cache.com/qdda
+ ******************************************************************************/
+
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <climits>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+
+#include "error.h"
+#include "tools.h"
+#include "fsmap.h"
+
+using std::string;
+
+/*******************************************************************************
+ * On-disk integers - ext4 is little endian, XFS big endian
+ ******************************************************************************/
+
+static uint64 le(const unsigned char* p, int bytes) {
+  uint64 v = 0;
+  for(int i=bytes-1; i>=0; i--) v = (v << 8) | p[i];
+  return v;
+}
+
+static uint64 be(const unsigned char* p, int bytes) {
+  uint64 v = 0;
+  for(int i=0; i<bytes; i++) v = (v << 8) | p[i];
+  return v;
+}
+
+// ext4 group has a superblock backup (and GDT), sparse_super: 0, 1 and powers of 3, 5, 7
+static bool hasSuper(int64 g, bool sparse) {
+  if(!sparse || g <= 1) return true;
+  for(int64 b : { 3, 5, 7 }) {
+    int64 n = b;
+    while(n < g) n *= b;
+    if(n == g) return true;
+  }
+  return false;
+}
+
+// true if the file (device) is listed as a mount source
+static bool isMounted(const string& filename) {
+  char path[PATH_MAX], src[PATH_MAX];
+  if(!realpath(filename.c_str(), path)) return false;
+  std::ifstream mounts("/proc/mounts");
+  string line;
+  while(std::getline(mounts, line)) {
+    string dev = line.substr(0, line.find(' '));
+    if(dev[0] == '/' && realpath(dev.c_str(), src) && !strcmp(src, path)) return true;
+  }
+  return false;
+}
+
+/*******************************************************************************
+ * FsMap class functions
+ ******************************************************************************/
+
+FsMap::FsMap(int f, const char* t) { fd = f; fstype = t; free = 0; fssize = 0; blocksize = 0; }
+FsMap::~FsMap() { close(fd); }
+
+FsMap* FsMap::load(const string& filename, string& msg) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if(fd < 0) { msg = "cannot open"; return NULL; }
+  unsigned char sb[2048];
+  if(pread(fd, sb, sizeof(sb), 0) != sizeof(sb)) { close(fd); msg = "no filesystem found"; return NULL; }
+
+  FsMap* map = NULL;
+  if(le(sb + 1024 + 0x38, 2) == 0xEF53)      map = new FsMap(fd, "ext2");  // ext3/4 set by loadext4
+  else if(be(sb, 4) == 0x58465342)           map = new FsMap(fd, "xfs");   // XFSB
+  else { close(fd); msg = "no ext2/3/4 or XFS filesystem found"; return NULL; }
+
+  if(isMounted(filename)) { msg = string(map->type()) + " filesystem is mounted"; delete map; return NULL; }
+  try {
+    if(map->fstype[0] == 'e') map->loadext4(sb + 1024);
+    else                      map->loadxfs(sb);
+  }
+  catch (Fatal& e) { // unsupported or not clean, scan all blocks
+    msg = string(map->type()) + ": " + e.what();
+    delete map;
+    return NULL;
+  }
+  return map;
+}
+
+void FsMap::read(void* buf, size_t bytes, int64 offset) {
+  if(pread(fd, buf, bytes, offset) != (ssize_t)bytes) throw ERROR("read error at offset ") << offset;
+}
+
+void FsMap::addfree(int64 offset, int64 bytes) {
+  if(offset + bytes > fssize) bytes = fssize - offset;
+  if(bytes <= 0) return;
+  free += bytes;
+  if(!ranges.empty() && ranges.back().first + ranges.back().second == offset) ranges.back().second += bytes;
+  else ranges.push_back(Range(offset, bytes));
+}
+
+bool FsMap::isfree(int64 offset, int64 bytes) {
+  // last range that starts at or before offset
+  auto it = std::upper_bound(ranges.begin(), ranges.end(), Range(offset, INT64_MAX));
+  if(it == ranges.begin()) return false;
+  --it;
+  return offset + bytes <= it->first + it->second;
+}
+
+/*******************************************************************************
+ * ext2/3/4 - block groups with a block bitmap each (bit set = in use).
+ * With uninit_bg/metadata_csum, groups flagged BLOCK_UNINIT have no bitmap on
+ * disk yet, they only hold their superblock backup + GDT and (with flex_bg)
+ * possibly bitmaps and inode tables of other groups, all marked in use here.
+ ******************************************************************************/
+
+void FsMap::loadext4(const unsigned char* sb) {
+  const uint64 compat    = le(sb + 0x5C, 4);
+  const uint64 incompat  = le(sb + 0x60, 4);
+  const uint64 ro_compat = le(sb + 0x64, 4);
+  if(!(le(sb + 0x3A, 2) & 1) || (incompat & 0x4)) throw ERROR("filesystem not clean (needs fsck or journal recovery)");
+  if(incompat & 0x10)       throw ERROR("meta_bg not supported");
+  if(compat & 0x200)        throw ERROR("sparse_super2 not supported");
+
+  if(incompat & 0x40)       fstype = "ext4";                 // extents
+  else if(compat & 0x4)     fstype = "ext3";                 // journal
+  blocksize           = 1024LL << le(sb + 0x18, 4);
+  const bool  is64    = incompat & 0x80;
+  const int64 blocks  = le(sb + 0x04, 4) + (is64 ? le(sb + 0x150, 4) << 32 : 0);
+  const int64 first   = le(sb + 0x14, 4);
+  const int64 bpg     = le(sb + 0x20, 4);
+  const int64 ipg     = le(sb + 0x28, 4);
+  const int64 isize   = le(sb + 0x4C, 4) ? le(sb + 0x58, 2) : 128;
+  const int   descsz  = is64 ? std::max((int)le(sb + 0xFE, 2), 32) : 32;
+  const int64 resgdt  = le(sb + 0xCE, 2);
+  const bool  csum    = ro_compat & (0x10 | 0x400); // gdt_csum or metadata_csum: bg_flags valid
+  if(blocksize > 65536 || !bpg || bpg > blocksize * 8 || !blocks) throw ERROR("invalid superblock");
+
+  const int64 groups   = (blocks - first + bpg - 1) / bpg;
+  const int64 gdtblks  = (groups * descsz + blocksize - 1) / blocksize;
+  const int64 itblocks = (ipg * isize + blocksize - 1) / blocksize;
+  fssize = blocks * blocksize;
+
+  std::vector<unsigned char> gdt(gdtblks * blocksize);
+  read(&gdt[0], gdt.size(), (first + 1) * blocksize);
+
+  // metadata blocks (bitmaps, inode tables) of all groups, for uninitialized groups
+  std::vector<Range> meta; // block, count
+  for(int64 g=0; g<groups; g++) {
+    const unsigned char* d = &gdt[g * descsz];
+    bool hi = descsz >= 64;
+    meta.push_back(Range(le(d + 0x0, 4) + (hi ? le(d + 0x20, 4) << 32 : 0), 1));
+    meta.push_back(Range(le(d + 0x4, 4) + (hi ? le(d + 0x24, 4) << 32 : 0), 1));
+    meta.push_back(Range(le(d + 0x8, 4) + (hi ? le(d + 0x28, 4) << 32 : 0), itblocks));
+  }
+  std::sort(meta.begin(), meta.end());
+
+  std::vector<unsigned char> bitmap(blocksize);
+  for(int64 g=0; g<groups; g++) {
+    const unsigned char* d = &gdt[g * descsz];
+    const int64 start = first + g * bpg;
+    const int64 count = std::min(bpg, blocks - start);
+    if(csum && (le(d + 0x12, 2) & 0x2)) { // BLOCK_UNINIT
+      std::fill(bitmap.begin(), bitmap.end(), 0);
+      auto mark = [&](int64 b, int64 n) { for(int64 i=std::max(b, start); i<std::min(b+n, start+count); i++) bitmap[(i-start)/8] |= 1 << ((i-start)%8); };
+      if(hasSuper(g, ro_compat & 0x1)) mark(start, 1 + gdtblks + resgdt); // superblock backup + GDT
+      auto it = std::upper_bound(meta.begin(), meta.end(), Range(start, INT64_MAX));
+      if(it != meta.begin()) --it;       // may start before the group
+      for(; it != meta.end() && it->first < start + count; ++it) mark(it->first, it->second);
+    }
+    else read(&bitmap[0], blocksize, (le(d + 0x0, 4) + (descsz >= 64 ? le(d + 0x20, 4) << 32 : 0)) * blocksize);
+    for(int64 i=0; i<count; i++)
+      if(!(bitmap[i/8] & (1 << (i%8)))) addfree((start + i) * blocksize, blocksize);
+  }
+}
+
+/*******************************************************************************
+ * XFS - allocation groups each with a free space B-tree sorted by block number.
+ * The AGF (second sector of the AG) has the root block and height of the tree,
+ * records are (startblock, blockcount) relative to the AG
+ ******************************************************************************/
+
+void FsMap::loadxfs(const unsigned char* sb) {
+  blocksize             = be(sb + 4, 4);
+  const int64 dblocks   = be(sb + 8, 8);
+  const int64 agblocks  = be(sb + 84, 4);
+  const int64 agcount   = be(sb + 88, 4);
+  const int64 sectsize  = be(sb + 102, 2);
+  if(blocksize < 512 || blocksize > 65536 || !agblocks || !agcount || sectsize < 512 || sectsize > 32768)
+    throw ERROR("invalid superblock");
+  if(sb[126]) throw ERROR("filesystem creation in progress");
+  fssize = dblocks * blocksize;
+  xfslog(sb);
+
+  std::vector<unsigned char> agf(sectsize);
+  for(int64 ag=0; ag<agcount; ag++) {
+    int64 agstart = ag * agblocks * blocksize;
+    read(&agf[0], sectsize, agstart + sectsize);
+    if(be(&agf[0], 4) != 0x58414746) throw ERROR("bad AGF magic in AG ") << ag;   // XAGF
+    xfswalk(agstart, be(&agf[16], 4), be(&agf[28], 4) - 1);
+  }
+}
+
+/*******************************************************************************
+ * XFS log - the free space B-trees are only up to date if the log is clean,
+ * i.e. the last log record is an unmount record (same check as the kernel does
+ * at mount time). The log is a ring of 512 byte basic blocks (BB), each starts
+ * with the cycle number (record headers: magic, then cycle). Blocks before the
+ * head have the current cycle, blocks after it the previous one (or 0).
+ ******************************************************************************/
+
+const uint64 kxlog_magic   = 0xFEEDBABE;
+const int    kxlog_bb      = 512;
+const int    kxlog_maxback = 1024;       // BBs to search back for the last record header
+const int    kxlog_unmount = 0x20;       // XLOG_UNMOUNT_TRANS (op header flags)
+
+// cycle number of log block bb
+uint32_t FsMap::xlogcycle(int64 logstart, int64 bb) {
+  unsigned char b[8];
+  read(b, sizeof(b), logstart + bb * kxlog_bb);
+  return be(b, 4) == kxlog_magic ? be(b + 4, 4) : be(b, 4);
+}
+
+void FsMap::xfslog(const unsigned char* sb) {
+  const int64 logfsb   = be(sb + 48, 8);
+  const int64 agblocks = be(sb + 84, 4);
+  const int64 logbbs   = be(sb + 96, 4) * blocksize / kxlog_bb;
+  const int   agblklog = sb[124];
+  if(!logfsb) throw ERROR("external log, cannot check if the filesystem is clean");
+  if(logbbs < 2) throw ERROR("invalid log size");
+  const int64 logstart = ((logfsb >> agblklog) * agblocks + (logfsb & ((1LL << agblklog) - 1))) * blocksize;
+
+  // head = first block with another cycle than block 0 (0 if all are the same)
+  const uint32_t cycle = xlogcycle(logstart, 0);
+  if(!cycle) throw ERROR("log is empty");
+  int64 head = 0;
+  if(xlogcycle(logstart, logbbs - 1) != cycle) {
+    int64 lo = 0, hi = logbbs - 1; // cycle(lo) == cycle, cycle(hi) != cycle
+    while(hi - lo > 1) {
+      int64 mid = (lo + hi) / 2;
+      if(xlogcycle(logstart, mid) == cycle) lo = mid; else hi = mid;
+    }
+    head = hi;
+  }
+
+  // last record header before the head
+  std::vector<unsigned char> b(kxlog_bb);
+  int64 rec = -1;
+  for(int64 n=1; n<=std::min(logbbs, (int64)kxlog_maxback) && rec < 0; n++) {
+    int64 bb = (head - n + logbbs) % logbbs;
+    read(&b[0], kxlog_bb, logstart + bb * kxlog_bb);
+    if(be(&b[0], 4) == kxlog_magic) rec = bb;
+  }
+  if(rec < 0) throw ERROR("no log record found");
+  const int64 version = be(&b[8], 4);
+  const int64 hsize   = be(&b[320], 4);
+  const int64 hblks   = ((version & 2) && hsize > 32768) ? (hsize + 32767) / 32768 : 1;
+  if(be(&b[40], 4) != 1) throw ERROR("filesystem not clean (log needs recovery)");
+  read(&b[0], kxlog_bb, logstart + ((rec + hblks) % logbbs) * kxlog_bb); // first op header
+  if(!(b[9] & kxlog_unmount)) throw ERROR("filesystem not clean (log needs recovery)");
+}
+
+// walk the bnobt from block agbno (level 0 = leaf), leaves are visited in key order
+void FsMap::xfswalk(int64 agstart, uint32_t agbno, int level) {
+  std::vector<unsigned char> blk(blocksize);
+  read(&blk[0], blocksize, agstart + (int64)agbno * blocksize);
+  uint64 magic = be(&blk[0], 4);
+  int hdr;
+  if(magic == 0x41425442)      hdr = 16; // ABTB (v4)
+  else if(magic == 0x41423342) hdr = 56; // AB3B (v5, with CRC)
+  else throw ERROR("bad bnobt magic at AG block ") << agbno;
+  if((int)be(&blk[4], 2) != level) throw ERROR("bnobt level mismatch at AG block ") << agbno;
+  const int64 numrecs = be(&blk[6], 2);
+
+  if(level == 0) {
+    if(hdr + numrecs * 8 > blocksize) throw ERROR("bnobt leaf overflow at AG block ") << agbno;
+    for(int64 i=0; i<numrecs; i++)
+      addfree(agstart + (int64)be(&blk[hdr + 8*i], 4) * blocksize, (int64)be(&blk[hdr + 8*i + 4], 4) * blocksize);
+    return;
+  }
+  const int64 maxrecs = (blocksize - hdr) / 12; // keys (8 bytes) then pointers (4 bytes)
+  if(numrecs > maxrecs) throw ERROR("bnobt node overflow at AG block ") << agbno;
+  for(int64 i=0; i<numrecs; i++)
+    xfswalk(agstart, be(&blk[hdr + maxrecs*8 + 4*i], 4), level - 1);
+}
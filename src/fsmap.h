@@ -0,0 +1,54 @@
+/*******************************************************************************
+ * Title       : fsmap.h
+ * Description : header file for fsmap.cpp - filesystem free space maps
+ * Author      : Bart Sjerps <bart@dirty-cache.com>
+ * License     : GPLv3+, https://www.gnu.org/licenses/gpl-3.0.txt
+ * Disclaimer  : GPLv3+
+ * URL         : https://wiki.dirty-cache.com/qdda
+ ******************************************************************************/
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "tools.h"
+
+/*******************************************************************************
+ * FsMap - free space of an ext2/3/4 or XFS filesystem on a device or image
+ * file (--fsaware). Read-only, the filesystem must not be mounted because the
+ * on-disk allocation info of a mounted filesystem is not up to date.
+ * - ext2/3/4: block bitmap of each block group (uninitialized bitmaps are
+ *   free except for the group metadata)
+ * - XFS: free space B-tree by block number (bnobt) of each allocation group
+ * The free space is kept as a sorted list of byte ranges, blocks on the AGFL
+ * (XFS) and anything outside the filesystem are considered allocated.
+ ******************************************************************************/
+
+class FsMap {
+public:
+  // returns NULL (and the reason in msg) if there is no usable filesystem
+  static FsMap* load(const std::string& filename, std::string& msg);
+ ~FsMap();
+  bool  isfree(int64 offset, int64 bytes);  // true if the whole range is unallocated
+  int64 freebytes()  { return free; }       // unallocated bytes
+  int64 size()       { return fssize; }     // filesystem size in bytes
+  const char* type() { return fstype; }
+private:
+  FsMap(int fd, const char* type);
+  FsMap(const FsMap&) = delete;
+  void  read(void* buf, size_t bytes, int64 offset);
+  void  addfree(int64 offset, int64 bytes); // add a free range (ascending order)
+  void  loadext4(const unsigned char* sb);
+  void  loadxfs(const unsigned char* sb);
+  void  xfswalk(int64 agstart, uint32_t agbno, int level);
+  void  xfslog(const unsigned char* sb);    // throws if the log is not clean
+  uint32_t xlogcycle(int64 logstart, int64 bb);
+  typedef std::pair<int64,int64> Range;     // offset, length in bytes
+  std::vector<Range> ranges;
+  int64       free;
+  int64       fssize;
+  int         fd;
+  const char* fstype;
+  int64       blocksize;                    // filesystem blocksize (bytes)
+};
@@ -269,11 +269,11 @@ Show detailed histograms from the database
 .B Example output
 .nf
 File list:
-file      blksz     blocks         MiB date               url
-1         16384       8192         128 20190204_0944      workstation:/dev/urandom
-2         16384      16384         256 20190204_0944      workstation:/dev/urandom
-3         16384      32768         512 20190204_0944      workstation:/dev/zero
-4         16384      32768         512 20190204_0944      workstation:/dev/urandom
+file      blksz     blocks         MiB    zero    dupe   compr date               url
+1         16384       8192         128    0.00   74.31    2.01 20190204_0944      workstation:/dev/urandom
+2         16384      16384         256    0.00   50.85    1.99 20190204_0944      workstation:/dev/urandom
+3         16384      32768         512  100.00    0.00       - 20190204_0944      workstation:/dev/zero
+4         16384      32768         512    0.00    1.12    2.00 20190204_0944      workstation:/dev/urandom
 
 Dedupe histogram:
 dup            blocks         perc          MiB
@@ -306,7 +306,10 @@ Total:          57344       896.00       100.00        30969               483.8
 .B Explanation
 .P
 .B File\ list
-shows info on the files that were scanned.
+shows info on the files that were scanned. zero is the percentage of zero blocks, dupe the (estimated) percentage of blocks
+that are duplicates of other blocks within the same file, and compr the compression ratio of the sampled non-zero blocks
+of the file (before bucket allocation). These are collected per file during the scan, so no extra pass over the data or database
+is needed. The duplicate percentage is estimated from the file's hash sketch and has an error of a few percent.
 .P
 .B Dedupe\ histogram
 .P
@@ -385,6 +388,79 @@ dd bs=16K status=none count=1 if=/dev/sda skip=181 | md5sum
                  |-------------| --> Note that the last 15 hex digits (equal to 60 bits) match the hexadecimal hash value in the database.
 .fi
 
+.B qdda -q --extents > extents.csv
+.P
+Dumps statistics per extent (default 256MiB, change with --extent <mib> when scanning) of each scanned file in CSV format.
+Useful to find where in a device the zero, duplicate and incompressible data is located, for example a tablespace tail or a backup area.
+Columns are file id, offset (MiB), size (MiB), blocks, zero (percentage of zero blocks), dupe (percentage of blocks that were already
+seen earlier in the scan, in file order), compr (compression ratio of the sampled blocks). The extent statistics are collected during the scan
+and do not require the staging table. The dupe percentage is based on a 1 in 16 sample of the hash values and a bloom filter of 32MiB,
+it is empty if no hashes in the extent were sampled.
+
+.B qdda -q --sql "select file, count(*) from sketches group by file"
+.P
+Runs an ad-hoc SQL query on the database and prints the result in CSV format. Unlike the sqlite3 tool, this
+also has access to qdda's virtual tables. If a staging database exists (i.e. after scanning with --nomerge), it
+is attached as schema 'staging' and the tables kv, files and extents and all v_ views show the results as if the staging data
+was merged (the database itself is not changed). Use main.kv, main.files etc. for the merged data only, or staging.staging for the raw
+unmerged hashes.
+.P
+Virtual tables:
+.IP sketches(file,hash)
+The hashes in the per-file bottom-k sketches, unpacked on the fly from the files table. Filter on file for best performance.
+.IP kv_live(hash,blocks,bytes,tags)
+The kv table combined with the unmerged staging data (if attached), in hash order. This is what kv shows with --sql after --nomerge.
+
+.B qdda --trace-hashes /tmp/scan.trace /dev/sdb /dev/sdc
+.br
+.B qdda -d /tmp/replay.db --replay /tmp/scan.trace
+.P
+The first command scans as usual but also writes a hash trace: the hash and compressed size of every block, with file and offset, in the order
+the blocks were processed. The trace is gzip compressed and takes about 10 bytes per block (a 16K blocksize trace of 1TB is about 700MB).
+The second command replays the trace into a (new) database without reading any data, at memory speed. This is useful to rerun analysis
+(different extent sizes, reports, or external tools reading the trace) without scanning the devices again.
+The database must have the same blocksize and compression method as the trace (use the same --array and --compress options).
+A trace from an interrupted scan is incomplete and cannot be replayed.
+
+.B qdda --delta /dev/sdb /dev/sdc
+.P
+Also detects blocks that are similar but not identical to an earlier scanned block (near-duplicates), which some arrays store as a
+difference (delta) against that block. For every non-zero block, the workers calculate 3 super-features (a resemblance sketch that
+is the same for blocks that share most of their contents, also at a different offset) in the same pass as the hash. The updater skips
+exact duplicates (these dedupe) and looks up the super-features in an in-memory index, a match means the block is similar to an earlier block.
+For a sample of the matches (1 in 8 by hash, against 1 in 8 references kept in memory), the delta size is estimated by compressing the
+block with LZ4 directly after the earlier block and compared to plain LZ4 compression of the block, which the workers calculate. The report then shows the similar capacity, the delta ratio (compressed size / delta size)
+and the estimated savings on top of dedupe and compression. This is an estimate of what is possible, arrays differ
+in how (and if) they find and store similar blocks. The index keeps about 1 million blocks per super-feature (more recent blocks
+replace older ones), similar blocks that are far apart in very large scans may be missed. Similar blocks are detected within one scan,
+not between scans that are merged or imported. Cannot be combined with --replay. Calculating super-features costs about as much CPU as
+hashing (see --cputest).
+
+.B qdda --fsaware /dev/sdb1 /tmp/backup.img
+.P
+Reads the allocation info of an ext2/3/4 or XFS filesystem on the device or image file and only reads the allocated blocks.
+Unallocated blocks are counted as free (zero) space and also reported separately as 'unallocated', they often contain stale data from
+deleted files that would otherwise be reported as used capacity (an array only stores what the filesystem writes or discards).
+Buffers that are completely unallocated are not read at all which makes scans of mostly empty filesystems much faster.
+The filesystem must be unmounted and clean (no journal recovery pending), else qdda reports why it cannot use the filesystem
+and scans all blocks. The filesystem is opened read-only. Supported: ext2/3/4 (block bitmaps, also with uninit_bg/metadata_csum,
+not with meta_bg or sparse_super2) and XFS (free space B-trees, blocks on the AG free list are considered allocated; the internal log
+must end with an unmount record, an external log cannot be checked so such filesystems are always scanned fully).
+
+.B qdda -d /var/lib/qdda/host.db --trickle 4096 --metrics /var/log/qdda.metrics /dev/sdb /dev/sdc
+.P
+Continuous low-impact scan to keep dedupe and compression estimates up to date without a full scan. qdda runs in rounds: each round
+reads a random selection of extents (see --extent) of every file, 4096 MiB in total, merges it into the database and updates the
+estimates. The round size is rounded down to whole extents and must be at least one extent (default 256 MiB). The extent order is a random permutation per pass, so after all rounds of a pass every extent is scanned exactly once,
+in the same proportion for each file. The database holds the data of the current pass, the report shows the pass so far and a
+"Rolling estimate" section: the history (average of completed passes, the last pass weighs 50%) blended with the current pass
+weighted by 50% of its coverage, so the estimate does not jump when a pass completes. Each round is also saved in the table 'estimates' (kept 30 days, see --sql) and written to the metrics
+file (trickle.* values). Trickle runs at nice 19 and idle I/O priority with 1 worker and 10 MB/s unless --workers or --bandwidth
+are given. It runs until interrupted (ctrl-c discards the current round only) or for a number of rounds (--trickle 4096:10).
+The database is not deleted, a restart continues the pass where it was. Other files, file sizes, --extent or --trickle size start
+over. Use large rounds (GiBs): each merge rewrites the kv table of the current pass. Cannot be combined with --replay,
+--trace-hashes or --nomerge.
+
 .SH COMBINING MULTIPLE SCANS
 By default, when scanning data, qdda deletes the existing database and creates a new one.
 Using the --append option you can keep existing data
@@ -407,6 +483,55 @@ The newly created database qdda.db will contain data from both db1 and db2.
 The combined databases can be gathered from different servers (by copying
 the qdda.db files to one central location) so this
 allows one to create a data reduction analysis across multiple hosts.
+.P
+.B Overlap between files
+.P
+For each scanned file, qdda keeps a small bottom-k (MinHash) sketch of the block hashes in the files table
+(the 1024 smallest hashes). The sketches are copied with --import so they can be combined from multiple hosts.
+.B qdda --overlap
+shows the estimated amount of distinct (non-zero) data per file and a matrix with the estimated amount of data
+shared between each pair of files. This shows which LUNs, VMs or hosts share data, without storing the hashes per file.
+The estimates have an error of a few percent and are less accurate for small overlaps.
+.P
+.B Change rate between scans
+.P
+When the same data is scanned periodically (each scan in its own database), the
+.B --diff <olddb>
+option compares the current database with an older one:
+.P
+.nf
+qdda --db week1 /dev/<disk>
+qdda --db week2 /dev/<disk>
+qdda --db week2 --diff week1.db
+.fi
+.P
+It reports the capacity of new unique blocks (hashes not in the old database), freed blocks (hashes no longer present),
+refcount changes of unchanged blocks, the change rate (new unique blocks as percentage of the old deduped capacity) and the
+shift in the dedupe and compression histograms. Both kv tables are read once in hash order and joined on the fly, so runtime is
+linear with the database size and no extra disk space or memory is needed.
+.P
+.B Tagged groups of files
+.P
+Files can be tagged with a group name, either per file (file@tag) or for all files in a scan (--tag <name>).
+The tag is always the last part of a file argument, after an optional limit and repeat count (file[:mib[,repeat]]@tag),
+and cannot contain '/', ':' or ','. An '@' elsewhere in a path is part of the filename; a file with '@' in its last path
+component can be scanned by adding a colon (file@name:), or an explicit tag after it (file@name:@tag).
+The tags are kept with the files and as a bitmask per block hash in the kv table (max 63 tags per database),
+so one database can hold multiple sets of LUNs, arrays or hosts and still report on each of them:
+.P
+.nf
+qdda /dev/sdb@array1 /dev/sdc@array1 /dev/sdd@array2
+qdda --append --tag array3 /dev/sde /dev/sdf
+qdda --groups all
+qdda --groups array1,array2+array3
+.fi
+.P
+--groups takes a comma separated list of groups, where a group is a tag or a union of tags (a+b), or "all" for
+each tag and the union of all tags. For each group it shows the total and zero capacity of its files, the
+deduped capacity (distinct data within the group), the exclusive capacity (data not found in files outside the group,
+i.e. what would be freed by moving the group away), dedupe and compression ratio, followed by a matrix of deduped capacity
+shared between each pair of groups. The kv table is read once for all groups. Tags are matched by name with --import.
+Files without a tag are not part of any group.
 .SH RESOURCE REQUIREMENTS
 .B Storage capacity
 .P
@@ -470,7 +595,11 @@ will be limited to those threads.
 allocates a number of read buffers which are 1 MiB each. The amount of buffers is set to #workers + #readers + 32. So on a
 system with 8 cores reading 2 files, the amount of buffers = 2 + 8 + 32 = 42 MiB.
 .br
-qdda also requires additional memory for SQLite, etc. but the total required memory usually fits in less than 100MiB.
+qdda also requires additional memory for SQLite, two bloom filters (32MiB each) for the duplicate counts per file and per extent, etc.
+but the total required memory usually fits in less than 150MiB.
+With --delta, another 112MiB is used for the similarity index (48MiB), the bloom filter for duplicates (32MiB) and the sampled
+reference blocks (32MiB).
+With --trickle, the database holds one pass (the kv table of a full scan of the files), estimates add a few bytes per round.
 
 .SH EXPLANATION
 How qdda works:
@@ -547,6 +676,25 @@ which is fine for datasets up to many terabytes.
 A 64-bit hash would get roughly 1 collision every 77TB@16K. A collision would be a serious problem for a deduplicating storage array
 but for an analysis tool a few collisions are not a serious problem so we can get away with using truncated hashes.
 .P
+.B Live estimates during the scan
+.P
+While scanning, the progress line shows running estimates of the thin, dedupe and compression ratios, for example:
+.br
+90000 16k blocks (1406 MiB) processed,    260/305 MB/s (cur/avg), 59% ETA 0:00:04, thin 1.17 dedupe 1.84 compr 1.15 (est)
+.br
+The percentage and ETA are shown if the size of all inputs is known up front: the device size for block devices, the file size for files,
+or the limit if specified (i.e. /dev/sdb:1024). The ETA is based on the throughput, smoothed over the last seconds. Inputs without known
+size (pipes) disable the overall ETA. The readers pick the largest files first (based on allocated space for sparse files, and pipes first)
+so that a large file is not started last which would delay the end of the scan.
+.br
+These are calculated from lightweight counters kept by the worker threads (zero blocks, a HyperLogLog distinct count
+estimate of the hashes with about 1% error, and a histogram of the compressed sizes of the sampled blocks rounded to the array buckets)
+so they are available long before the merge is done. The compression estimate includes all sampled blocks, not only the unique ones,
+so it may differ from the final report if duplicate blocks compress differently than unique blocks. With --metrics <file> the
+estimates are also written to the metrics file (scan.blocks, scan.zero, scan.distinct, scan.thin, scan.dedupe, scan.compress) once per second,
+as well as the overall ETA in seconds (scan.eta) and the percentage done and ETA per file (scan.file.<n>.done, scan.file.<n>.eta where n is the position
+of the file on the command line).
+.P
 .B Notes on compression algorithm
 .P
 .B qdda
@@ -583,6 +731,14 @@ The overview shows how fast a single core can hash, compress and update a datase
 Intel Core i5-4440 CPU @ 3.10GHz). The reference dataset is a random(ish) block of data and the numbers are an indication only.
 Note that the compress rate is inaccurate but repeatable. A real dataset is usually less random and may show higher or lower speeds.
 .P
+Newer versions also show the super-features rate (--delta) and the worker path for a block: zero check, hash and LZ4 compression as
+separate passes over the block versus the fused kernel the workers use, which processes each block in 16K tiles so the tile is zero checked,
+hashed and compressed while it is still in the CPU cache (LZ4 in steps just below 4K, blocks larger than 16K compress about 1% worse
+than in one call). The 'Fused saving' line shows the measured difference per block and the compressed size relative to one call at the
+database blocksize, followed by the same comparison for the blocksize, compression method and sample interval of each array profile
+(first 256 MiB of the dataset). The difference is small at 16K blocks and on CPUs with a large L2 cache, it may be larger for 128K
+blocks when many workers compete for cache and memory bandwidth, which a single thread test does not show.
+.P
 A data scan by default will allocate 1 thread per file, 1 thread for database updates and the number of worker threads equal to the
 amount of cpu cures. Experience shows that the bottleneck is usually read IO bandwidth until the database updater is maxed out (on a
 fast reference system this happened at about 7000MB/s). Future versions may use multiple updater threads to avoid this bottleneck.
@@ -605,6 +761,14 @@ or setting SQLITE_TMPDIR (also helps if you run out of diskspace).
 .br
 You can avoid the merge (join) phase and delay it to a later moment using the "--nomerge" (no report) option.
 Ideal if you scan on a slow server with limited space and you want to do the heavy lifting on a faster host later.
+.P
+Database I/O - qdda uses its own SQLite VFS (file access layer) which collects page writes in 1MiB buffers, and preallocates
+database and temp files in extents of up to 64MiB to keep them contiguous. File locking is left to the standard SQLite
+file layer, so it is safe to access the database with other tools (e.g. sqlite3) while qdda runs. The '--dropcache' option removes SQLite temporary files
+(used for sorting during the merge) from the Linux page cache after writing, so they do not push out cached data of the scan or the
+databases. The I/O counters per database file can be written to a metrics file with '--metrics <file>'. Each line has the format
+'<epoch> <name> <value>', for example '1539000000 vfs.qdda.db.iowrites 57' (physical writes) versus 'vfs.qdda.db.writes' (page writes by SQLite).
+Temporary files are counted together as 'vfs.temp'.
 
 .SH CONFIG FILES
 None, everything is contained in the SQLite database and command line options
@@ -672,6 +836,9 @@ nc -l 902 | qdda
 Database journaling and synchronous mode are disabled for performance reasons. This means the internal database may be corrupted if qdda is ended
 in an abnormal way (killed, file system full, etc).
 .br
+qdda locks its database files through the standard SQLite file layer. Another qdda process or SQLite tool that writes to a database
+in use waits or fails with 'database is locked' instead of changing it.
+.br
 Accessing the SQLite database directly requires recent versions of the sqlite3 tools. Older versions are not compatible with the database
 schema and abort with an error upon opening.
 .br
@@ -722,8 +889,8 @@ _qdda() {
 
   shortopts=(V h m d a q b x n)
   longopts+=(version help man db append delete quiet bandwidth array)
-  longopts+=(compress detail dryrun purge import cputest nomerge debug queries)
-  longopts+=(tmpdir workers readers findhash tophash squash bashdump complete demo)
+  longopts+=(compress detail overlap extents extent delta fsaware trickle dryrun trace-hashes replay purge import cputest nomerge debug queries)
+  longopts+=(tmpdir dropcache metrics workers readers findhash tophash squash bashdump complete demo diff sql tag groups)
 
   opts=$(printf "\x2d%s " "${shortopts[@]}")
   opts+=$(printf "\x2d\x2d%s " "${longopts[@]}")
@@ -742,18 +909,32 @@ _qdda() {
        --array)     COMPREPLY=($(compgen -W "x1 x2 vmax pmax list custom:blksz:buckets" -- ${cur})) ;;
        --compress)  COMPREPLY=($(compgen -W "none lz4 deflate lz4" -- ${cur})) ;;
     -x|--detail)    COMPREPLY=($(compgen -W "$opts" -- ${cur})) ;;
+       --overlap)   COMPREPLY=($(compgen -W "$opts" -- ${cur})) ;;
+       --extents)   COMPREPLY=($(compgen -W "$opts" -- ${cur})) ;;
+       --extent)    COMPREPLY=($(compgen -W "64 256 1024" -- ${cur})) ;;
+       --delta)     COMPREPLY=($(compgen -W "$opts" -- ${cur})) ;;
+       --fsaware)   COMPREPLY=($(compgen -f -- "${cur}")) ;;
+       --trickle)   COMPREPLY=($(compgen -W "1024 4096 16384" -- ${cur})) ;;
     -n|--dryrun)    COMPREPLY=($(compgen -W "$opts" -- ${cur})) ;;
+       --trace-hashes) COMPREPLY=($(compgen -f -- "${cur}")) ;;
+       --replay)    COMPREPLY=($(compgen -f -- "${cur}")) ;;
        --purge)     ;;
        --import)    COMPREPLY=($(compgen -f -X "!*.db" -- "${cur}")) ;;
+       --diff)      COMPREPLY=($(compgen -f -X "!*.db" -- "${cur}")) ;;
        --cputest)   ;;
        --nomerge)   COMPREPLY=($(compgen -W "$opts" -- ${cur})) ;;
        --debug)     COMPREPLY=($(compgen -W "$opts" -- ${cur})) ;;
        --queries)   COMPREPLY=($(compgen -W "$opts" -- ${cur})) ;;
        --tmpdir)    COMPREPLY=($(compgen -W "/tmp /var/tmp" -- ${cur}))  ;;
+       --dropcache) COMPREPLY=($(compgen -W "$opts" -- ${cur})) ;;
+       --metrics)   COMPREPLY=($(compgen -f -- "${cur}")) ;;
        --workers)   COMPREPLY=($(compgen -W "1 2 4 8 16 32" -- ${cur})) ;;
        --readers)   COMPREPLY=($(compgen -W "1 2 4 8 16" -- ${cur})) ;;
        --findhash)  ;;
        --tophash)   COMPREPLY=($(compgen -W "5 10 25" -- ${cur})) ;;
+       --sql)       ;;
+       --tag)       ;;
+       --groups)    COMPREPLY=($(compgen -W "all" -- ${cur})) ;;
        --squash)    ;;
        --bashdump)  ;;
        --complete)  ;;
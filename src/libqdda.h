@@ -0,0 +1,132 @@
+/*******************************************************************************
+ * Title       : libqdda.h
+ * Description : qdda library API - embed the qdda scan engine in other programs
+ * Author      : Bart Sjerps <bart@dirty-cache.com>
+ * License     : GPLv3+, https://www.gnu.org/licenses/gpl-3.0.txt
+ * Disclaimer  : GPLv3+
+ * URL         : https://wiki.dirty-cache.com/qdda
+ ******************************************************************************/
+
+#pragma once
+
+#include <string>
+#include <sstream>
+#include <iomanip>
+#include <fstream>
+#include <vector>
+#include <memory>
+#include <thread>
+
+#include "tools.h"
+#include "database.h"
+#include "qdda.h"
+
+struct SharedData;
+class  TraceReader;
+class  TraceWriter;
+class  DeltaIndex;
+
+/*******************************************************************************
+ * The scan engine (reader, worker and updater threads) and the databases are
+ * built as a static library (libqdda.a, link with zlib/libz.a -lpthread -ldl).
+ * The qdda command line tool is built on top of it. Programs that already have
+ * the data in memory can feed it to the engine without an extra process or pipe
+ * (complete program in example.cpp, built with 'make example'):
+ *
+ *   QddaDB::createdb("/tmp/job.db");                  // new database
+ *   QddaDB db("/tmp/job.db");
+ *   db.setmetadata(16, Metadata::lz4, 1, Metadata::x2, buckets);
+ *   Parameters p = {};                                // workers, buffers etc
+ *   p.stagingname = "/tmp/job-staging.db";
+ *   p.workers = 8; p.extent = 256;
+ *   ScanEngine engine(db, p);
+ *   int s = engine.addstream("backup-job-1");         // streams, sources or files
+ *   engine.start();
+ *   engine.push(s, data, bytes);                      // as often as needed
+ *   engine.finish();                                  // wait until all is processed
+ *   db.merge(p.stagingname);                          // results are now in db (kv, files)
+ *   Database::deletedb(p.stagingname);
+ *   report(db);
+ *
+ * Data can be provided in 3 ways:
+ * - addfile(): a file or device, read by the engine's reader threads
+ * - addstream(): the program pushes the data with push(). The data is copied
+ *   into the scan buffers, the caller's buffer can be reused when push returns.
+ *   Streams can be pushed from multiple threads, but one thread per stream
+ * - addsource(): a zero-copy BlockSource, the reader threads get chunks of
+ *   data from the source and the workers hash and compress them in place
+ *
+ * Errors are thrown as Fatal (error.h), like in the rest of qdda
+ ******************************************************************************/
+
+/*******************************************************************************
+ * BlockSource - zero-copy data source. next() is called from a reader thread,
+ * done() from the updater thread when the chunk is no longer used (not called
+ * for chunks still in flight when the scan is aborted).
+ * Chunks should be a multiple of the blocksize except the last one, a partial
+ * block at the end of a chunk is copied and padded with zeroes.
+ ******************************************************************************/
+
+class BlockSource {
+public:
+  virtual ~BlockSource() {}
+  virtual size_t next(const char*& data) = 0; // next chunk of data, returns bytes, 0 = end of stream
+  virtual void   done(const char* data) = 0;  // chunk (as returned by next) is processed
+};
+
+/*******************************************************************************
+ * LiveStats - estimates while scanning (see --metrics and the progress line)
+ ******************************************************************************/
+
+struct LiveStats {
+  int64  blocks;   // blocks processed
+  int64  bytes;    // bytes processed
+  int64  zero;     // zero blocks
+  double distinct; // estimated distinct non-zero blocks
+  double thin;     // estimated thin ratio
+  double dedupe;   // estimated dedupe ratio
+  double compr;    // estimated compression ratio (bucketed)
+  int64  eta;      // seconds remaining, -1 if unknown
+};
+
+/*******************************************************************************
+ * ScanEngine - runs a scan into the staging database (Parameters::stagingname)
+ * Add all files/streams/sources, then start(), push(), finish().
+ ******************************************************************************/
+
+class ScanEngine {
+public:
+  ScanEngine(QddaDB& db, Parameters& parameters);
+ ~ScanEngine();
+  int  addfile(const FileData& file);                     // returns the file index
+  int  addstream(const std::string& name, const std::string& tag = "", int64 size = -1);
+  int  addsource(const std::string& name, BlockSource* source, const std::string& tag = "", int64 size = -1);
+                                                          // size in bytes for progress/ETA, -1 = unknown
+  void start();                                           // start threads, create staging database
+  void push(int stream, const char* data, size_t bytes);  // add data to a stream (throws if aborted)
+  void endstream(int stream);                             // stream complete (called by finish if not done)
+  void finish();                                          // wait for all data, save file info
+  void stats(LiveStats& s);                               // current estimates
+  const v_FileData& files() { return filelist; }
+private:
+  ScanEngine(const ScanEngine&) = delete;
+  void submit(int stream, const char* data, size_t bytes, int64 offset); // copy data to a free buffer
+  QddaDB&                     db;
+  Parameters&                 parameters;
+  v_FileData                  filelist;
+  std::unique_ptr<SharedData> sd;
+  std::unique_ptr<StagingDB>  stagingdb;
+  std::unique_ptr<TraceReader> replay;
+  std::unique_ptr<TraceWriter> trace;
+  std::unique_ptr<DeltaIndex> delta;      // similar blocks (--delta)
+  std::vector<std::thread>    readthreads;// readers and replayer
+  std::vector<std::thread>    workthreads;
+  std::thread                 updatethread;
+  std::vector<std::vector<char>> pushbuf; // partial buffer per pushed stream
+  std::vector<int64>          pushed;     // bytes pushed per stream
+  std::vector<char>           ended;      // stream complete
+  std::vector<int64>          tagids;     // tag id per file, 0 = untagged
+  std::vector<std::unique_ptr<FsMap>> fsmaps; // filesystem maps (--fsaware)
+  Stopwatch                   stopwatch;
+  bool                        started;
+};
@@ -0,0 +1,581 @@
+/*******************************************************************************
+ * Title       : main.cpp
+ * Description : qdda command line interface - options, reports and scans on
+ *               top of the qdda library (libqdda)
+ * Author      : Bart Sjerps <bart@dirty-cache.com>
+ * License     : GPLv3+
+ * Disclaimer  : See https://www.gnu.org/licenses/gpl-3.0.txt
+ * More info   : https://wiki.dirty-cache.com/qdda
+ ******************************************************************************/
+
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+
+#include <signal.h>
+
+#include "error.h"
+#include "tools.h"
+#include "database.h"
+#include "qdda.h"
+#include "vfs.h"
+#include "delta.h"
+#include "trickle.h"
+
+using std::string;
+using std::stringstream;
+using std::left;
+using std::setw;
+using std::setprecision;
+using std::endl;
+using std::cout;
+using std::flush;
+
+/*******************************************************************************
+ * global parameters - modify at own discretion
+ ******************************************************************************/
+
+const int kdefault_bandwidth = 200;
+const int ktrickle_bandwidth = 10;
+const int kmax_reader_threads = 8;
+const int kdefault_extent = 256;
+
+extern const char* PROGVERSION;
+extern bool g_debug;
+extern bool g_query;
+extern bool g_quiet;
+extern std::ofstream c_metrics;
+
+/*******************************************************************************
+ * Usage (from external files)
+ ******************************************************************************/
+
+const char * version_info  = 
+  "Copyright (C) 2018 Bart Sjerps <bart@dirty-cache.com>\n"
+  "License GPLv3+: GNU GPL version 3 or later <http://gnu.org/licenses/gpl.html>\n"
+  "This is free software: you are free to change and redistribute it.\n"
+  "There is NO WARRANTY, to the extent permitted by law.\n\n"
+  "build date: " __DATE__  "\nbuild time: " __TIME__ "\n";
+
+
+const char * title_info = " - The Quick & Dirty Dedupe Analyzer\n"
+  "Use for educational purposes only - actual array reduction results may vary\n";
+
+extern const char* manpage_head;
+extern const char* manpage_body;
+extern const char* bash_complete;
+
+void showtitle()    { if(!g_quiet) cout << "qdda " << PROGVERSION << title_info ; }
+void showversion()  { showtitle(); std::cout << version_info << std::endl; }
+void showcomplete() { std::cout << bash_complete; }
+
+/*******************************************************************************
+ * Various
+ ******************************************************************************/
+
+/*******************************************************************************
+ * Functions
+ ******************************************************************************/
+
+// Import another database
+void import(QddaDB& db, const string& filename) {
+  if(!Database::isValid(filename.c_str())) return;
+  QddaDB idb(filename);
+  int64 blocksize = db.getblocksize();
+  if(blocksize != idb.getblocksize()) throw ERROR("Incompatible blocksize on") << filename;
+  cout << "Adding " << idb.getrows() << " blocks from " << filename << " to " << db.getrows() << " existing blocks" << endl;
+  db.import(filename);
+}
+
+// Compare with an older database (snapshot) of the same data
+void diff(QddaDB& db, const string& filename) {
+  if(!Database::isValid(filename.c_str())) throw ERROR("Not a valid database: ") << filename;
+  QddaDB olddb(filename);
+  if(db.getblocksize() != olddb.getblocksize()) throw ERROR("Incompatible blocksize on ") << filename;
+  reportDiff(db, olddb);
+}
+
+// Merge staging data into kv table, track & display time to merge
+void merge(QddaDB& db, Parameters& parameters) {
+  if(!Database::isValid(parameters.stagingname.c_str())) return;
+  
+  StagingDB sdb(parameters.stagingname);
+
+  sql_int blocksize    = db.getblocksize();
+  sql_int dbrows       = db.getrows();
+  sql_int tmprows      = sdb.getrows();
+  sql_int mib_staging  = tmprows*blocksize/1024;
+  sql_int mib_database = dbrows*blocksize/1024;
+  sql_int fsize1       = db.filesize();
+  sql_int fsize2       = sdb.filesize();
+
+  if(blocksize != sdb.blocksize()) throw ERROR("Incompatible blocksize on stagingdb");
+  
+  sdb.close();
+
+  Stopwatch stopwatch;
+  if(tmprows) { // do nothing if merge db has no rows
+    if(!g_quiet) cout 
+      << "Merging " << tmprows << " blocks (" 
+      << mib_staging << " MiB) with " 
+      << dbrows << " blocks (" 
+      << mib_database << " MiB)" << flush;
+
+    stopwatch.reset();
+    uint64 index_rps = tmprows*1000000/stopwatch;
+    uint64 index_mbps = mib_staging*1000000/stopwatch;
+    
+    stopwatch.reset();
+    db.merge(parameters.stagingname);
+    stopwatch.lap();
+    
+    auto time_merge = stopwatch;
+    uint64 merge_rps = (tmprows+dbrows)*1000000/time_merge;
+    uint64 merge_mbps = (mib_staging+mib_database)*1000000/time_merge;
+    if(!g_quiet) cout << " in "
+      << stopwatch.seconds() << " sec (" 
+      << merge_rps << " blocks/s, " 
+      << merge_mbps << " MiB/s)" << endl;
+  }
+  Database::deletedb(parameters.stagingname);
+}
+
+// Continuous low-impact scan (--trickle <mib>[:n]) in rounds of <mib> MiB,
+// each round is scanned, merged and added to the rolling estimates. Runs until
+// interrupted unless the number of rounds is given
+void trickle(QddaDB& db, Parameters& parameters, const string& spec, const std::vector<string>& files) {
+  stringstream ss(spec);
+  string strmib, strrounds;
+  getline(ss, strmib, ':');
+  getline(ss, strrounds);
+  int64 mib       = atoll(strmib.c_str());
+  int64 maxrounds = atoll(strrounds.c_str());
+  if(mib < 1 || maxrounds < 0) throw ERROR("Invalid trickle size: ") << spec;
+  if(files.empty()) throw ERROR("No files to scan with --trickle");
+  if(!parameters.replay.empty() || !parameters.tracefile.empty() || parameters.skip)
+    throw ERROR("Cannot combine --trickle with --replay, --trace-hashes or --nomerge");
+
+  lowPriority();
+  v_FileData filelist;
+  for(size_t i=0; i<files.size(); i++) filelist.push_back(FileData(files[i]));
+  Trickle state(db, filelist, (int64)parameters.extent * 1048576, mib * 1048576);
+  if(!g_quiet) cout << "Trickle scan pass " << state.pass << ", " << state.round << "/" << state.rounds
+                    << " rounds done, " << mib << " MiB per round" << endl;
+
+  for(int64 n=0; !maxrounds || n<maxrounds; n++) {
+    if(n) { // new streams, readers close them
+      filelist.clear();
+      for(size_t i=0; i<files.size(); i++) filelist.push_back(FileData(files[i]));
+    }
+    state.plan(filelist);
+    analyze(filelist, db, parameters);
+    for(size_t i=0; i<filelist.size(); i++) delete filelist[i].ifs;
+    if(g_abort) return;
+    merge(db, parameters);
+    state.done();
+  }
+}
+
+// test hashing, compression and insert performance
+void cputest(QddaDB& db, Parameters& p) {
+
+  StagingDB::createdb(p.stagingname,db.getblocksize());
+  StagingDB stagingdb(p.stagingname);
+  
+  const int64 mib       = 1024; // size of test set
+  const int64 blocksize = db.getblocksize();
+
+  const int64 rows      = mib * 1024 / blocksize;
+  const int64 bufsize   = mib * 1024 * 1024;
+  char*       testdata  = new char[bufsize];
+  uint64*     hashes    = new uint64[rows];
+  int64*      bytes     = new int64[rows];
+  int64 time_hash, time_compress, time_insert;
+  char buf[blocksize*1024];
+  
+  Stopwatch   stopwatch;
+  
+  cout << std::fixed << setprecision(2) << "*** Synthetic performance test, 1 thread ***" << endl;
+
+  cout << "Initializing:" << flush;
+  srand(1);
+  memset(testdata,0,bufsize);
+  for(int64 i=0;i<bufsize;i++) testdata[i] = (char)rand() % 8; // fill test buffer with random(ish) but compressible data
+  cout << setw(15) << rows << " blocks, " << blocksize << "k (" << bufsize/1048576 << " MiB)" << endl;
+
+  cout << left << setw(18) << "Hashing:" << flush;
+  stopwatch.reset();
+  for(int64 i=0;i<rows;i++) hashes[i] = hash_md5(testdata + i*blocksize*1024,buf,blocksize*1024);
+  time_hash = stopwatch.lap();
+  
+  cout << setw(15) << time_hash     << " usec, " 
+       << setw(10) << (float)bufsize/time_hash << " MB/s, " 
+       << setw(11) << (float)rows*1000000/time_hash << " rows/s"
+       << endl;
+
+  cout << left << setw(18) << "Compress DEFLATE:" << flush;
+  stopwatch.reset();
+  
+  for(int64 i=0;i<rows;i++) bytes[i] = compress_deflate(testdata + i*blocksize*1024,buf,blocksize*1024);
+  time_compress = stopwatch.lap();
+  cout << setw(15) << time_compress << " usec, " 
+       << setw(10) << (float)bufsize/time_compress << " MB/s, " 
+       << setw(11) << (float)rows*1000000/time_compress << " rows/s"
+       << endl;
+
+  cout<< left << setw(18) << "Compress LZ4:" << flush;
+  stopwatch.reset();
+
+  for(int64 i=0;i<rows;i++) bytes[i] = compress_lz4(testdata + i*blocksize*1024,buf,blocksize*1024);
+  time_compress = stopwatch.lap();
+  cout << setw(15) << time_compress << " usec, " 
+       << setw(10) << (float)bufsize/time_compress << " MB/s, " 
+       << setw(11) << (float)rows*1000000/time_compress << " rows/s"
+       << endl;
+
+  cout<< left << setw(18) << "Super-features:" << flush;
+  stopwatch.reset();
+
+  uint64 sf[kdelta_sfs];
+  for(int64 i=0;i<rows;i++) superFeatures(testdata + i*blocksize*1024,blocksize*1024,sf);
+  time_compress = stopwatch.lap();
+  cout << setw(15) << time_compress << " usec, " 
+       << setw(10) << (float)bufsize/time_compress << " MB/s, " 
+       << setw(11) << (float)rows*1000000/time_compress << " rows/s"
+       << endl;
+
+  // the worker path: separate passes (zero check, hash, compress) vs the fused tiled kernel
+  int64 time_separate, time_fused, bytes_separate = 0, bytes_fused = 0;
+  cout<< left << setw(18) << "Separate MD5+LZ4:" << flush;
+  stopwatch.reset();
+  for(int64 i=0;i<rows;i++) {
+    hash_md5(testdata + i*blocksize*1024,buf,blocksize*1024);
+    bytes_separate += compress_lz4(testdata + i*blocksize*1024,buf,blocksize*1024);
+  }
+  time_separate = stopwatch.lap();
+  cout << setw(15) << time_separate << " usec, " 
+       << setw(10) << (float)bufsize/time_separate << " MB/s, " 
+       << setw(11) << (float)rows*1000000/time_separate << " rows/s"
+       << endl;
+
+  cout<< left << setw(18) << "Fused MD5+LZ4:" << flush;
+  BlockKernel kernel(Metadata::lz4, blocksize*1024);
+  int cbytes;
+  stopwatch.reset();
+  for(int64 i=0;i<rows;i++) {
+    kernel.process(testdata + i*blocksize*1024, true, cbytes);
+    bytes_fused += cbytes;
+  }
+  time_fused = stopwatch.lap();
+  cout << setw(15) << time_fused << " usec, " 
+       << setw(10) << (float)bufsize/time_fused << " MB/s, " 
+       << setw(11) << (float)rows*1000000/time_fused << " rows/s"
+       << endl;
+  cout << left << setw(18) << "Fused saving:"
+       << setw(15) << 100.0 - 100.0*time_fused/time_separate << " % time, "
+       << setw(10) << (float)(time_separate - time_fused)/rows << " usec/block ("
+       << blocksize << "K blocks, " << ktile_size/1024 << "K tiles), compressed size "
+       << 100.0*bytes_fused/bytes_separate << " %" << endl;
+
+  // same for the blocksize, compression and sample interval of each array profile (first 256 MiB)
+  const char* profiles[] = { "x1", "x2", "vmax", "pmax" };
+  const int64 profbytes  = std::min(bufsize, (int64)256*1048576);
+  for(size_t a=0; a<sizeof(profiles)/sizeof(profiles[0]); a++) {
+    Metadata md;
+    md.setArray(profiles[a]);
+    const int64 bs = md.getBlocksize()*1024;
+    const int64 n  = profbytes / bs;
+    std::vector<char> pbuf(bs);
+    stopwatch.reset();
+    for(int64 i=0;i<n;i++) {
+      hash_md5(testdata + i*bs, pbuf.data(), bs);
+      if(i % md.getInterval()) continue;
+      if(md.getMethod() == Metadata::deflate) compress_deflate(testdata + i*bs, pbuf.data(), bs);
+      else                                    compress_lz4(testdata + i*bs, pbuf.data(), bs);
+    }
+    time_separate = stopwatch.lap();
+    BlockKernel pkernel(md.getMethod(), bs);
+    stopwatch.reset();
+    for(int64 i=0;i<n;i++) pkernel.process(testdata + i*bs, i % md.getInterval() == 0, cbytes);
+    time_fused = stopwatch.lap();
+    cout << left << setw(18) << string("  ") + profiles[a] + ":"
+         << setw(15) << 100.0 - 100.0*time_fused/time_separate << " % time, "
+         << setw(10) << (float)time_separate/n << " -> " << (float)time_fused/n << " usec/block ("
+         << md.getBlocksize() << "K blocks, " << Metadata::getMethodName(md.getMethod()) << ":" << md.getInterval() << ")" << endl;
+  }
+
+
+  cout << left << setw(18) << "DB insert:" << flush;
+  stopwatch.reset();
+
+  stagingdb.begin();
+  for(int64 i=0;i<rows;i++) stagingdb.insertdata(hashes[i],bytes[i]);
+  stagingdb.end();
+  time_insert = stopwatch.lap();
+  cout << setw(15) << time_insert << " usec, "
+       << setw(10) << (float)bufsize/time_insert   << " MB/s, "
+       << setw(11) << (float)rows*1000000/time_insert << " rows/s"
+       << endl;
+
+  delete[] testdata;
+  delete[] hashes;
+  delete[] bytes;
+  Database::deletedb(p.stagingname);
+}
+
+// Run man command with generated man page text
+void manpage() {
+  string cmd = "(";
+  cmd += whoAmI();
+  cmd += " --mandump > /tmp/qdda.1 ; man /tmp/qdda.1 ; rm /tmp/qdda.1 )";
+  if(!system(cmd.c_str())) { };
+}
+
+// Return default database path
+const string& defaultDbName() {
+  static string dbname;
+  dbname = homeDir() + "/qdda.db";
+  return dbname;
+}
+
+// show short help
+void showhelp(LongOptions& lo) {
+  std::cout << "\nUsage: qdda <options> [FILE]...\nOptions:" << "\n";
+  lo.printhelp(cout);
+  std::cout << "\nMore info: qdda --man \nor the project homepage: https://wiki.dirty-cache.com/qdda\n\n";
+}
+
+// dump manpage to stdout
+void mandump(LongOptions& lo) {
+  cout << manpage_head;
+  lo.printman(cout);
+  cout << manpage_body;
+}
+
+// call self with demo parameters
+void rundemo() {
+  string cmd = "";
+  cmd += whoAmI();
+  cmd += " -d /tmp/demo compress:128,4 compress:256,2 compress:512 zero:512";
+  cout << "Running: " << cmd << endl << endl;
+  if(!system(cmd.c_str())) { };
+}
+
+// find offsets for a given hash
+void findhash(Parameters& parameters, uint64 searchhash) {
+  StagingDB db(parameters.stagingname);
+  IntArray tabs;
+  tabs << 20 << 20 << 10 << 10;
+  Query findhash(db,"select * from offsets where hash=?");
+  findhash.bind(searchhash);
+  findhash.report(cout,tabs);
+}
+
+// find N hashes with highest dupcount
+void tophash(QddaDB& db, int amount = 10) {
+  Query tophash(db,"select hash,blocks from kv where hash!=0 and blocks>1 order by blocks desc limit ?");
+  IntArray tabs;
+  tabs << 20 << 10;
+  tophash.bind(amount);
+  tophash.report(cout,tabs);
+}
+
+// run ad-hoc SQL (including virtual tables), staging db is attached as 'staging' if it exists
+void sqlquery(QddaDB& db, Parameters& parameters, const string& sql) {
+  bool staging = Database::isValid(parameters.stagingname.c_str()) && Database::exists(parameters.stagingname);
+  if(staging) db.live(parameters.stagingname);
+  Query q(db, sql.c_str());
+  q.csv(cout);
+}
+
+// update sum tables
+void update(QddaDB& db) {
+  db.update();
+}
+
+// safety guards against overwriting existing files or devices by SQLite
+void ParseFileName(string& name) {
+  char buf[160];
+  if(!getcwd(buf, 160)) throw ERROR("Get current directory failed");
+  string cwd = buf;
+  if(name.empty()) name = homeDir() + "/qdda.db";
+  if(name[0] != '/') name = cwd + "/" + name;
+  while (name.find("//") < string::npos) {
+    auto i=name.find("//");
+    name.replace(i,2,"/");
+  }
+  if (!name.compare(0,4,"/dev")  )   throw ERROR("/dev not allowed in filename: " ) << name;
+  if (!name.compare(0,5,"/proc") )   throw ERROR("/proc not allowed in filename: ") << name;
+  if (!name.compare(0,4,"/sys")  )   throw ERROR("/sys not allowed in filename: " ) << name;
+  if (!name.find_last_of("/\\"))     throw ERROR("root dir not allowed: "         ) << name;
+  if(name.find(".db")>name.length()) name += ".db";
+}
+
+// Return name for staging database - same dir as main database
+string genStagingName(string& name) {
+  string tmpname;
+  tmpname = name.substr(0,name.find(".db"));
+  tmpname += "-staging.db";
+  return tmpname;
+}
+
+/*******************************************************************************
+ * Main section - process options etc
+ ******************************************************************************/
+
+int main(int argc, char** argv) {
+  Parameters  parameters = {};
+  Options     opts = {};
+  Metadata    metadata;
+
+  // set default values (workers and bandwidth after parsing, trickle has other defaults)
+  parameters.workers   = 0;
+  parameters.readers   = kmax_reader_threads;
+  parameters.bandwidth = -1;
+  parameters.extent    = kdefault_extent;
+
+  Parameters& p = parameters; // shorthand alias
+  Options& o = opts;
+
+  try {
+    LongOptions opts;
+    opts.add("version"  ,'V', ""             , showversion,  "show version and copyright info");
+    opts.add("help"     ,'h', ""             , o.do_help,    "show usage");
+    opts.add("man"      ,'m', ""             , manpage,      "show detailed manpage");
+    opts.add("db"       ,'d', "<file>"       , o.dbname,     "database file path (default $HOME/qdda.db)");
+    opts.add("append"   ,'a', ""             , o.append,     "Append data instead of deleting database");
+    opts.add("delete"   , 0 , ""             , o.do_delete,  "Delete database");
+    opts.add("quiet"    ,'q', ""             , g_quiet,      "Don't show progress indicator or intermediate results");
+    opts.add("bandwidth",'b', "<mb/s>"       , p.bandwidth,  "Throttle bandwidth in MB/s (default 200, trickle 10, 0=disable)");
+    opts.add("array"    , 0 , "<list|array>" , o.array,      "show/set arraytype or custom (see man page section STORAGE ARRAYS)");
+    opts.add("compress" , 0 , "<method>"     , o.compress,   "set compression method <none|lz4|deflate>[:interval]");
+    opts.add("detail"   ,'x', ""             , o.detail,     "Detailed report (file info and dedupe/compression histograms)");
+    opts.add("overlap"  , 0 , ""             , o.overlap,    "Report estimated data overlap between scanned files");
+    opts.add("extents"  , 0 , ""             , o.extents,    "Dump zero/dupe/compression statistics per file extent (CSV)");
+    opts.add("extent"   , 0 , "<mib>"        , p.extent,     "Extent size for extent statistics (default 256)");
+    opts.add("delta"    , 0 , ""             , p.delta,      "Detect similar blocks and estimate delta compression savings");
+    opts.add("fsaware"  , 0 , ""             , p.fsaware,    "Skip unallocated blocks of (unmounted) ext2/3/4 and XFS filesystems");
+    opts.add("trickle"  , 0 , "<mib[:n]>"    , o.trickle,    "Continuous low-impact scan, <mib> per round (n rounds), rolling estimates");
+    opts.add("dryrun"   ,'n', ""             , p.dryrun,     "skip staging db updates during scan");
+    opts.add("trace-hashes", 0, "<file>"     , p.tracefile,  "Write hash trace (scan results in scan order) to <file>");
+    opts.add("replay"   , 0 , "<file>"       , p.replay,     "Replay a hash trace instead of scanning files");
+    opts.add("purge"    , 0 , ""             , o.do_purge,   "Reclaim unused space in database (sqlite vacuum)");
+    opts.add("import"   , 0 , "<file>"       , o.import,     "import another database (must have compatible metadata)");
+    opts.add("diff"     , 0 , "<olddb>"      , o.diff,       "Report changes against an older database (change rate, dedupe drift)");
+    opts.add("tag"      , 0 , "<name>"       , p.tag,        "Group tag for scanned files without file@tag");
+    opts.add("groups"   , 0 , "<spec>"       , o.groups,     "Report dedupe/overlap for tag groups, i.e. a,b,a+b or all");
+    opts.add("cputest"  , 0 , ""             , o.do_cputest, "Single thread CPU performance test");
+    opts.add("nomerge"  , 0 , ""             , p.skip,       "Skip staging data merge and reporting, keep staging database");
+    opts.add("debug"    , 0 , ""             , g_debug,      "Enable debug output");
+    opts.add("queries"  , 0 , ""             , g_query,      "Show SQLite queries and results");
+    opts.add("tmpdir"   , 0 , "<dir>"        , p.tmpdir,     "Set $SQLITE_TMPDIR for temporary files");
+    opts.add("dropcache", 0 , ""             , o.dropcache,  "Keep SQLite temporary files out of the page cache");
+    opts.add("metrics"  , 0 , "<file>"       , o.metrics,    "Write metrics (I/O counters etc.) to <file>");
+    opts.add("workers"  , 0 , "<wthreads>"   , p.workers,    "number of worker threads (default cpus, trickle 1)");
+    opts.add("readers"  , 0 , "<rthreads>"   , p.readers,    "(max) number of reader threads");
+    opts.add("findhash" , 0 , "<hash>"       , o.shash,      "find blocks with hash=<hash> in staging db");
+    opts.add("tophash"  , 0 , "<num>"        , o.tophash,    "show top <num> hashes by refcount");
+    opts.add("sql"      , 0 , "<query>"      , o.query,      "run SQL query on the database (CSV output)");
+    opts.add("squash"   , 0 , ""             , o.squash,     "set all refcounts to 1");
+    opts.add("mandump"  , 0 , ""             , o.do_mandump, "dump raw manpage to stdout");
+    opts.add("bashdump" , 0 , ""             , o.do_bashdump,"dump bash_completion script to stdout");
+    opts.add("demo"     , 0 , ""             , rundemo,      "show quick demo");
+#ifdef __DEBUG
+    opts.add("update"   , 0 , ""             , o.do_update,  "update temp tables (debug only!)");
+    opts.add("buffers"  , 0 , "<buffers>"    , p.buffers,    "number of buffers (debug only!)");
+#endif
+
+    int rc=opts.parse(argc,argv);
+    if(rc) return 0; // opts.parse executed a message function
+    
+    if(o.do_help)          { showhelp(opts); return 0; }
+    else if(o.do_mandump)  { mandump(opts); return 0; }
+    else if(o.do_bashdump) { showcomplete(); return 0; }
+
+    if(p.workers<1)   p.workers   = o.trickle.empty() ? cpuCount() : 1;
+    if(p.bandwidth<0) p.bandwidth = o.trickle.empty() ? kdefault_bandwidth : ktrickle_bandwidth;
+    if(!p.tmpdir.empty()) setenv("SQLITE_TMPDIR",p.tmpdir.c_str(),1);
+    if(p.extent<1) throw ERROR("Invalid extent size: ") << p.extent;
+    if(!o.metrics.empty()) {
+      c_metrics.open(o.metrics, std::ofstream::app);
+      if(!c_metrics.is_open()) throw ERROR("Cannot open metrics file ") << o.metrics;
+    }
+    vfsRegister(o.dropcache);
+  
+    showtitle();
+    ParseFileName(o.dbname);
+    p.stagingname = genStagingName(o.dbname);
+    
+    if(o.do_delete)  {
+      if(!g_quiet) cout << "Deleting database " << o.dbname << endl;
+      Database::deletedb(o.dbname); return 0;
+    }
+    if(o.array.size()>0) { if(metadata.setArray(o.array)) return 0; }
+    if(!o.compress.empty()) metadata.setMethod(o.compress);
+  }
+  catch (Fatal& e) { e.print(); return 10; }
+
+
+  v_FileData filelist;
+
+  try {
+    // Build filelist
+    if(!p.replay.empty() && optind<argc) throw ERROR("Cannot combine --replay with files to scan");
+    if(o.trickle.empty() && (optind<argc || !isatty(fileno(stdin)) || !p.replay.empty())) {
+      if (!isatty(fileno(stdin)) && p.replay.empty())
+        filelist.push_back(FileData("/dev/stdin"));
+      for (int i = optind; i < argc; ++i)
+        filelist.push_back(FileData(argv[i]));
+      if(!o.append) { // not appending -> delete old database
+        if(!g_quiet) cout << "Creating new database " << o.dbname << endl;
+        Database::deletedb(o.dbname);
+        QddaDB::createdb(o.dbname);
+      }
+    }
+    if(o.do_cputest && !o.append) {
+      if(!g_quiet) cout << "Creating new database " << o.dbname << endl;
+      Database::deletedb(o.dbname);
+      QddaDB::createdb(o.dbname);
+    }
+    if(!Database::exists(o.dbname)) QddaDB::createdb(o.dbname);
+    QddaDB db(o.dbname);
+
+    db.setmetadata(metadata.getBlocksize(), metadata.getMethod(), metadata.getInterval(), metadata.getArray(), metadata.getBuckets());
+
+    if(!o.trickle.empty()) // keeps the database, rolling scan state is in it
+      trickle(db, parameters, o.trickle, std::vector<string>(argv + optind, argv + argc));
+    else if(filelist.size()>0 || !p.replay.empty())
+      analyze(filelist, db, parameters);
+
+    if(g_abort) return 1;
+
+    if     (o.do_purge)        { db.vacuum();            }
+    else if(!o.import.empty()) { import(db,o.import);    }
+    else if(!o.diff.empty())   { diff(db,o.diff);        }
+    else if(o.do_cputest)      { cputest(db,p) ;         }
+    else if(o.do_update)       { update(db) ;            }
+    else if(o.shash!=0)        { findhash(p, o.shash);   }
+    else if(o.tophash!=0)      { tophash(db, o.tophash); }
+    else if(!o.query.empty())  { sqlquery(db, p, o.query); }
+    else if(o.squash)          { db.squash();            }
+    else {
+      if(!parameters.skip)     { merge(db,parameters); }
+      if(o.detail)             { reportDetail(db); }
+      else if(o.overlap)       { reportOverlap(db); }
+      else if(o.extents)       { reportExtents(db); }
+      else if(!o.groups.empty()) { reportGroups(db, o.groups); }
+      else if (!p.skip)        { report(db); }
+    }
+  }
+  catch (std::bad_alloc& e) { ERROR("Out of memory").print(); return -1; }
+  catch (Fatal& e) { e.print(); return -1; }
+
+  if(c_metrics.is_open()) vfsMetrics(c_metrics);
+  return 0;  
+}
+
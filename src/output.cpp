@@ -11,10 +11,15 @@
 #include <sstream>
 #include <iomanip>
 #include <string>
+#include <map>
+#include <vector>
+#include <algorithm>
 
+#include "error.h"
 #include "tools.h"
 #include "database.h"
 #include "qdda.h"
+#include "sketch.h"
 
 using namespace std;
 extern bool g_quiet;
@@ -75,6 +80,7 @@ void report(QddaDB& db) {
   
   int64 blocks_total  = db.getint("select sum(blocks) from kv");                   // Total blocks (total file size)
   int64 blocks_free   = db.getint("select blocks from kv where hash=0");           // Total zero blocks
+  int64 blocks_unall  = db.getint("select sum(unalloc) from files");               // Zero blocks not read (--fsaware)
   int64 blocks_used   = db.getint("select sum(ref*blocks) from m_sums_deduped");   // Total used blocks
   int64 blocks_dedup  = db.getint("select sum(blocks) from m_sums_deduped");       // Unique hashes (deduped) between 0 and max
   int64 blocks_unique = db.getint("select blocks from m_sums_deduped where ref=1");          // Hashes with count=1 (non-dedupable data)
@@ -113,7 +119,10 @@ void report(QddaDB& db) {
   << col1 << "sample percentage"   << " = " << col2 << sample_perc << " %"
   << "\n\nOverview:"
   << col1 << "total"               << " = " << mib(blocks_total  * blocks2mb) << blocks(blocks_total  )
-  << col1 << "free (zero)"         << " = " << mib(blocks_free   * blocks2mb) << blocks(blocks_free   )
+  << col1 << "free (zero)"         << " = " << mib(blocks_free   * blocks2mb) << blocks(blocks_free   );
+  if(blocks_unall) cout
+  << col1 << "unallocated"         << " = " << mib(blocks_unall  * blocks2mb) << blocks(blocks_unall  );
+  cout
   << col1 << "used"                << " = " << mib(blocks_used   * blocks2mb) << blocks(blocks_used   )
   << col1 << "dedupe savings"      << " = " << mib(blocks_merged * blocks2mb) << blocks(blocks_merged )
   << col1 << "deduped"             << " = " << mib(blocks_dedup  * blocks2mb) << blocks(blocks_dedup  )
@@ -136,6 +145,43 @@ void report(QddaDB& db) {
   << col1 << "raw capacity"        << " = " << mib(blocks_total*blocks2mb)
   << col1 << "net capacity"        << " = " << mib(blocks_alloc*blocks2mb)
   << "\n" << endl;
+
+  // rolling estimate (--trickle), the overview above only has the current pass
+  Query q_trickle(db, "select strftime('%Y%m%d_%H%M', timestamp, 'unixepoch', 'utc'), pass, coverage, r_thin, r_dedupe, r_compress "
+                      "from estimates order by id desc limit 1");
+  if(q_trickle.next()) {
+    float r_thin   = q_trickle.getfloat(3);
+    float r_dedupe = q_trickle.getfloat(4);
+    float r_compr  = q_trickle.getfloat(5);
+    cout
+    << "Rolling estimate (trickle):"
+    << col1 << "updated"             << " = " << q_trickle.getstr(0) << " UTC"
+    << col1 << "pass"                << " = " << col2 << q_trickle.getint(1) << pct(q_trickle.getfloat(2))
+    << col1 << "deduplication ratio" << " = " << col2 << r_dedupe
+    << col1 << "compression ratio"   << " = " << col2 << r_compr
+    << col1 << "thin ratio"          << " = " << col2 << r_thin
+    << col1 << "combined"            << " = " << col2 << r_thin*r_dedupe*r_compr
+    << "\n" << endl;
+  }
+
+  // similar blocks (--delta): delta savings are extrapolated from the sampled pairs
+  int64 blocks_similar = db.getint("select sum(similar) from files");
+  if(!blocks_similar) return;
+  int64 delta_sampled  = db.getint("select sum(dsampled) from files");
+  int64 delta_cbytes   = db.getint("select sum(dcbytes) from files");
+  int64 delta_dbytes   = db.getint("select sum(dbytes) from files");
+  float ratio_delta    = safeDiv_float(delta_cbytes, delta_dbytes);
+  float delta_saved    = safeDiv_float(blocks_similar * (delta_cbytes - delta_dbytes), delta_sampled) * bytes2mb;
+
+  cout
+  << "Delta compression (estimate):"
+  << col1 << "similar"             << " = " << mib(blocks_similar * blocks2mb) << blocks(blocks_similar)
+  << col1 << "sampled pairs"       << " = " << col2 << delta_sampled;
+  if(delta_sampled) cout
+  << col1 << "delta ratio"         << " = " << col2 << ratio_delta
+  << col1 << "delta savings"       << " = " << mib(delta_saved)
+  << col1 << "net with delta"      << " = " << mib(std::max(blocks_alloc*blocks2mb - delta_saved, 0.0f))
+  << "\n" << endl;
 }
 
 /*******************************************************************************
@@ -152,7 +198,7 @@ void reportDetail(QddaDB& db) {
 
   cout << "File list:" << endl;
 
-  tabs << 8 << -6 << -10 << -11 << 18 << 80;
+  tabs << 8 << -6 << -10 << -11 << -7 << -7 << -7 << 18 << 80;
   filelist.report(cout, tabs);
   
   tabs.clear();
@@ -167,3 +213,290 @@ void reportDetail(QddaDB& db) {
   cout << endl << "Compression Histogram (" << db.getarrayid() << "): " << endl;
   compresshistogram.report(cout, tabs);
 }
+
+/*******************************************************************************
+ * Overlap report - estimated shared data between files using bottom-k sketches
+ ******************************************************************************/
+
+void reportOverlap(QddaDB& db) {
+  const float blocks2mb = db.getblocksize()/1024.0;
+  std::vector<BottomK> sketches;
+  std::vector<int64>   ids;
+  Query files(db,"select id, hostname || ':' || name, sketch from files order by id");
+
+  cout << "File list (distinct = estimated unique data per file, excluding zeroes):" << endl;
+  cout << left << setw(8) << "file" << right << setw(14) << "distinct MiB" << "  " << "url" << endl;
+  while(files.next()) {
+    ids.push_back(files.getint(0));
+    sketches.push_back(BottomK());
+    sketches.back().load(files.getblob(2));
+    cout << left << setw(8) << ids.back()
+         << right << setw(14) << fixed << setprecision(2) << sketches.back().distinct() * blocks2mb
+         << "  " << files.getstr(1) << endl;
+  }
+
+  // matrix of estimated shared MiB between each pair of files, diagonal is distinct MiB of the file itself
+  cout << endl << "Estimated overlap (MiB):" << endl << left << setw(8) << "file";
+  for(int i=0; i<ids.size(); i++) cout << right << setw(12) << ids[i];
+  cout << endl;
+  for(int i=0; i<ids.size(); i++) {
+    cout << left << setw(8) << ids[i];
+    for(int j=0; j<ids.size(); j++) {
+      double shared = (i==j) ? sketches[i].distinct() : sketches[i].shared(sketches[j]);
+      cout << right << setw(12) << fixed << setprecision(2) << shared * blocks2mb;
+    }
+    cout << endl;
+  }
+}
+
+/*******************************************************************************
+ * Extent report - per file extent statistics in CSV format (heatmap data)
+ ******************************************************************************/
+
+void reportExtents(QddaDB& db) {
+  Query extents(db,"select * from v_extents");
+  extents.csv(cout);
+}
+
+/*******************************************************************************
+ * Diff report - compare kv of current database with an older snapshot
+ * Both kv tables are read in hash order (primary key) and merge-joined in
+ * one pass, so runtime is linear in kv size and memory use is constant
+ * (apart from the histograms which only have an entry per refcount/size).
+ ******************************************************************************/
+
+// totals for a set of hashes (added, removed, ...)
+struct DiffSet {
+  DiffSet() { hashes=0; blocks=0; sampled=0; cbytes=0; }
+  void add(sql_int b, sql_int bytes, bool hasbytes) {
+    hashes++; blocks+=b;
+    if(hasbytes) { sampled++; cbytes += bytes; }
+  }
+  int64 hashes;  // distinct hashes
+  int64 blocks;  // sum of refcounts
+  int64 sampled; // hashes with compressed size
+  int64 cbytes;  // compressed bytes of sampled hashes
+};
+
+typedef std::map<int64,int64> Histogram;
+
+// print old and new histograms side by side
+void printHistogram(const char* title, const char* key, Histogram& h_old, Histogram& h_new) {
+  Histogram keys = h_old;
+  keys.insert(h_new.begin(), h_new.end());
+  cout << "\n" << title << ":\n"
+       << left << setw(8) << key << right << setw(14) << "old" << setw(14) << "new" << setw(14) << "delta" << "\n";
+  for(auto it = keys.begin(); it != keys.end(); ++it) {
+    int64 o = h_old.count(it->first) ? h_old[it->first] : 0;
+    int64 n = h_new.count(it->first) ? h_new[it->first] : 0;
+    cout << left << setw(8) << it->first << right << setw(14) << o << setw(14) << n << setw(14) << showpos << n-o << noshowpos << "\n";
+  }
+}
+
+void reportDiff(QddaDB& db, QddaDB& olddb) {
+  // compressed sizes are only comparable with the same method and sample interval
+  if(db.getblocksize() != olddb.getblocksize()) throw ERROR("Cannot compare databases with different blocksizes");
+  if(db.getmethod() != olddb.getmethod() || db.getinterval() != olddb.getinterval())
+    throw ERROR("Cannot compare databases with different compression (")
+      << Metadata::getMethodName(db.getmethod()) << ":" << db.getinterval() << " vs "
+      << Metadata::getMethodName(olddb.getmethod()) << ":" << olddb.getinterval() << ")";
+  const float blocks2mb = db.getblocksize()/1024.0;
+  Query q_new(db,   "select hash, blocks, bytes from kv order by hash");
+  Query q_old(olddb,"select hash, blocks, bytes from kv order by hash");
+
+  DiffSet added, removed, common_old, common_new;
+  int64 zero_old = 0, zero_new = 0, refs_up = 0, refs_down = 0;
+  Histogram dedupe_old, dedupe_new, compr_old, compr_new;
+
+  bool has_new = q_new.next();
+  bool has_old = q_old.next();
+  while(has_new || has_old) {
+    sql_int h_new = has_new ? q_new.getint(0) : 0;
+    sql_int h_old = has_old ? q_old.getint(0) : 0;
+    bool in_new = has_new && (!has_old || h_new <= h_old); // current hash is in new kv
+    bool in_old = has_old && (!has_new || h_old <= h_new); // current hash is in old kv
+    sql_int refs_n = in_new ? q_new.getint(1) : 0;
+    sql_int refs_o = in_old ? q_old.getint(1) : 0;
+
+    if((in_new ? h_new : h_old) == 0) { // zero blocks
+      zero_new = refs_n;
+      zero_old = refs_o;
+    } else {
+      if(in_new) {
+        dedupe_new[refs_n]++;
+        if(!q_new.isnull(2)) compr_new[(q_new.getint(2)+1023)/1024]++;
+      }
+      if(in_old) {
+        dedupe_old[refs_o]++;
+        if(!q_old.isnull(2)) compr_old[(q_old.getint(2)+1023)/1024]++;
+      }
+      if(in_new && in_old) {
+        common_new.add(refs_n, q_new.getint(2), !q_new.isnull(2));
+        common_old.add(refs_o, q_old.getint(2), !q_old.isnull(2));
+        if(refs_n > refs_o) refs_up   += refs_n - refs_o;
+        else                refs_down += refs_o - refs_n;
+      }
+      else if(in_new) added.add(refs_n, q_new.getint(2), !q_new.isnull(2));
+      else            removed.add(refs_o, q_old.getint(2), !q_old.isnull(2));
+    }
+    if(in_new) has_new = q_new.next();
+    if(in_old) has_old = q_old.next();
+  }
+
+  int64 total_old = removed.blocks + common_old.blocks + zero_old;
+  int64 total_new = added.blocks + common_new.blocks + zero_new;
+  int64 used_old  = removed.hashes + common_old.hashes; // deduped capacity in blocks
+  int64 used_new  = added.hashes + common_new.hashes;
+
+  // compressed capacity of new/removed hashes, extrapolated from the sampled hashes
+  float cmib_added   = safeDiv_float(added.cbytes, added.sampled) * added.hashes / 1048576;
+  float cmib_removed = safeDiv_float(removed.cbytes, removed.sampled) * removed.hashes / 1048576;
+
+  float dedup_old = safeDiv_float(total_old - zero_old, used_old);
+  float dedup_new = safeDiv_float(total_new - zero_new, used_new);
+  float compr_ratio_old = safeDiv_float((removed.sampled + common_old.sampled) * blocks2mb * 1048576, removed.cbytes + common_old.cbytes);
+  float compr_ratio_new = safeDiv_float((added.sampled + common_new.sampled) * blocks2mb * 1048576, added.cbytes + common_new.cbytes);
+
+  cout
+  << "\nDatabase diff (" << olddb.filename() << " -> " << db.filename() << "):"
+  << col1 << "total old"           << " = " << mib(total_old * blocks2mb) << blocks(total_old)
+  << col1 << "total new"           << " = " << mib(total_new * blocks2mb) << blocks(total_new)
+  << col1 << "zero old"            << " = " << mib(zero_old * blocks2mb) << blocks(zero_old)
+  << col1 << "zero new"            << " = " << mib(zero_new * blocks2mb) << blocks(zero_new)
+  << "\n\nChanges:"
+  << col1 << "new unique"          << " = " << mib(added.hashes * blocks2mb) << blocks(added.hashes)
+  << col1 << "new unique compr."   << " = " << mib(cmib_added)
+  << col1 << "new references"      << " = " << mib(added.blocks * blocks2mb) << blocks(added.blocks)
+  << col1 << "freed unique"        << " = " << mib(removed.hashes * blocks2mb) << blocks(removed.hashes)
+  << col1 << "freed unique compr." << " = " << mib(cmib_removed)
+  << col1 << "freed references"    << " = " << mib(removed.blocks * blocks2mb) << blocks(removed.blocks)
+  << col1 << "unchanged unique"    << " = " << mib(common_new.hashes * blocks2mb) << blocks(common_new.hashes)
+  << col1 << "refcount increase"   << " = " << mib(refs_up * blocks2mb) << blocks(refs_up)
+  << col1 << "refcount decrease"   << " = " << mib(refs_down * blocks2mb) << blocks(refs_down)
+  << "\n\nSummary:"
+  << col1 << "change rate"         << " = " << col2 << 100*safeDiv_float(added.hashes, used_old) << " %"
+  << col1 << "deduped capacity"    << " = " << mib((used_new - used_old) * blocks2mb) << " (delta)"
+  << col1 << "dedupe ratio old"    << " = " << col2 << dedup_old
+  << col1 << "dedupe ratio new"    << " = " << col2 << dedup_new
+  << col1 << "compress ratio old"  << " = " << col2 << compr_ratio_old
+  << col1 << "compress ratio new"  << " = " << col2 << compr_ratio_new
+  << "\n";
+
+  printHistogram("Dedupe histogram (hashes per refcount)", "ref", dedupe_old, dedupe_new);
+  printHistogram("Compression histogram (hashes per KiB size)", "size", compr_old, compr_new);
+  cout << endl;
+}
+
+/*******************************************************************************
+ * Groups report - dedupe within and overlap between groups of tagged files
+ * A group is a tag or a union of tags (a+b). kv is read once, each hash is
+ * counted in every group that holds at least one of its tags (kv.tags bitmask)
+ * so the capacity of any union is exact, not a sum of separate results.
+ ******************************************************************************/
+
+struct TagGroup {
+  TagGroup() { mask=0; files=0; blocks=0; zero=0; hashes=0; exclusive=0; sampled=0; cbytes=0; }
+  string name;
+  int64 mask;      // tag bits in this group
+  int64 files;     // number of files
+  int64 blocks;    // blocks scanned
+  int64 zero;      // zero blocks
+  int64 hashes;    // distinct non-zero hashes (deduped capacity in blocks)
+  int64 exclusive; // hashes not found in files outside the group
+  int64 sampled;   // hashes with compressed size
+  int64 cbytes;    // compressed bytes of sampled hashes
+};
+
+void reportGroups(QddaDB& db, const string& spec) {
+  const float blocks2mb = db.getblocksize()/1024.0;
+  std::map<string,int64> tags; // tag name -> bit in kv.tags
+  std::vector<TagGroup> groups;
+  string list;
+
+  Query q_tags(db,"select id, name from tags order by id");
+  while(q_tags.next()) {
+    tags[q_tags.getstr(1)] = (int64)1 << (q_tags.getint(0)-1);
+    list += (list.empty() ? "" : ",") + q_tags.getstr(1);
+  }
+  if(tags.empty()) throw ERROR("No tagged files in database, use --tag or file@tag when scanning");
+  if(spec=="all" && tags.size()>1) { // each tag and the union of all
+    string all = list;
+    std::replace(all.begin(), all.end(), ',', '+');
+    list += "," + all;
+  }
+  else if(spec!="all") list = spec;
+
+  stringstream ss(list);
+  string item, tag;
+  while(getline(ss, item, ',')) {
+    groups.push_back(TagGroup());
+    groups.back().name = item;
+    stringstream si(item);
+    while(getline(si, tag, '+')) {
+      if(!tags.count(tag)) throw ERROR("Unknown tag: ") << tag;
+      groups.back().mask |= tags[tag];
+    }
+  }
+  const int n = groups.size();
+
+  Query q_files(db,"select tag, count(*), sum(blocks), sum(zero) from files where tag not null group by tag");
+  while(q_files.next()) {
+    int64 bit = (int64)1 << (q_files.getint(0)-1);
+    for(int i=0; i<n; i++) {
+      if(!(groups[i].mask & bit)) continue;
+      groups[i].files  += q_files.getint(1);
+      groups[i].blocks += q_files.getint(2);
+      groups[i].zero   += q_files.getint(3);
+    }
+  }
+
+  // one pass over kv, shared[i*n+j] = hashes in both group i and j (i<j)
+  std::vector<int64> shared(n*n, 0);
+  std::vector<char>  in(n);
+  Query q_kv(db,"select tags, bytes from kv where hash!=0 and tags!=0");
+  while(q_kv.next()) {
+    int64 t = q_kv.getint(0);
+    bool  hasbytes = !q_kv.isnull(1);
+    for(int i=0; i<n; i++) {
+      TagGroup& g = groups[i];
+      in[i] = (t & g.mask) != 0;
+      if(!in[i]) continue;
+      g.hashes++;
+      if(!(t & ~g.mask)) g.exclusive++;
+      if(hasbytes) { g.sampled++; g.cbytes += q_kv.getint(1); }
+      for(int j=0; j<i; j++) if(in[j]) shared[j*n+i]++;
+    }
+  }
+
+  cout << "Tag groups (deduped = distinct data, exclusive = not shared with files outside the group):" << endl
+       << left << setw(8) << "group" << right << setw(7) << "files" << setw(14) << "total MiB" << setw(14) << "zero MiB"
+       << setw(14) << "deduped MiB" << setw(14) << "exclusive MiB" << setw(9) << "dedupe" << setw(9) << "compr"
+       << setw(14) << "alloc MiB" << "  " << "tags" << endl;
+  for(int i=0; i<n; i++) {
+    TagGroup& g = groups[i];
+    float dedupe = safeDiv_float(g.blocks - g.zero, g.hashes);
+    float compr  = safeDiv_float(g.sampled * blocks2mb * 1048576, g.cbytes);
+    cout << left << setw(8) << i+1 << right << setw(7) << g.files << fixed << setprecision(2)
+         << setw(14) << g.blocks * blocks2mb
+         << setw(14) << g.zero * blocks2mb
+         << setw(14) << g.hashes * blocks2mb
+         << setw(14) << g.exclusive * blocks2mb
+         << setw(9)  << dedupe
+         << setw(9)  << compr
+         << setw(14) << safeDiv_float(g.hashes * blocks2mb, compr)
+         << "  " << g.name << endl;
+  }
+
+  // matrix of deduped MiB shared between each pair of groups, diagonal is deduped MiB of the group itself
+  cout << endl << "Shared between groups (MiB):" << endl << left << setw(8) << "group";
+  for(int i=0; i<n; i++) cout << right << setw(12) << i+1;
+  cout << endl;
+  for(int i=0; i<n; i++) {
+    cout << left << setw(8) << i+1;
+    for(int j=0; j<n; j++) {
+      int64 h = (i==j) ? groups[i].hashes : shared[std::min(i,j)*n + std::max(i,j)];
+      cout << right << setw(12) << fixed << setprecision(2) << h * blocks2mb;
+    }
+    cout << endl;
+  }
+}
@@ -15,6 +15,8 @@
 #include <fstream>
 #include <string>
 #include <cstring>
+#include <cstdlib>
+#include <algorithm>
 
 #include <signal.h>
 
@@ -24,6 +26,7 @@
 #include "tools.h"
 #include "database.h"
 #include "qdda.h"
+#include "delta.h"
 
 extern "C" {
 #include "md5/md5.h"
@@ -48,9 +51,6 @@ const char* PROGVERSION = VERSION RELEASE;
 const char* PROGVERSION = "0.0.1";
 #endif
 
-const int kdefault_bandwidth = 200;
-const int kmax_reader_threads = 8;
-
 /*******************************************************************************
  * Initialization - globals
  ******************************************************************************/
@@ -58,32 +58,59 @@ const int kmax_reader_threads = 8;
 bool g_debug = false;        // global debug flag
 bool g_query = false;        // global query flag
 bool g_quiet = false;        // global quiet flag
-extern sig_atomic_t g_abort; // global abort flag
 
 uint64 starttime = epoch();  // start time of program
 
-std::ofstream c_debug; // Debug stream
+std::ofstream c_debug;   // Debug stream
+std::ofstream c_metrics; // Metrics stream (--metrics), lines of <epoch> <name> <value>
 
 /*******************************************************************************
  * Filedata class - info about files/streams to be scanned
  ******************************************************************************/
 
 FileData::FileData(const string& file) {
-  ratio=0; limit_mb=0;
-  stringstream ss(file);
+  ratio=0; limit_mb=0; bytes=0; source=NULL; fsmap=NULL;
+  string spec = file;
   string strlimit,strrepeat;
 
+  // optional group tag, always last: file[:limit[,repeat]]@tag. The tag cannot
+  // hold '/', ':' or ',' so an '@' elsewhere in the path is part of the filename
+  size_t at = spec.rfind('@');
+  if(at != string::npos && spec.find_first_of("/:,", at) == string::npos) {
+    tag = spec.substr(at+1);
+    spec.erase(at);
+    if(tag.empty()) throw ERROR("Empty tag in ") << file;
+  }
+
+  stringstream ss(spec);
   getline(ss,filename,':');
   getline(ss,strlimit,',');
   getline(ss,strrepeat);
+  if(filename.empty()) throw ERROR("Missing filename in ") << file;
   
   if(filename=="compress") ratio=1;
   if(filename=="compress") { filename = "/dev/urandom"; limit_mb=1024; }
   if(filename=="random")   { filename = "/dev/urandom"; limit_mb=1024; }
   if(filename=="zero")     { filename = "/dev/zero";    limit_mb=1024; }
   
-  if(!strlimit.empty()) limit_mb = atoll(strlimit.c_str());
-  repeat   = atoi(strrepeat.c_str());
+  char* end;
+  if(!strlimit.empty()) {
+    limit_mb = strtoll(strlimit.c_str(), &end, 10);
+    if(*end || limit_mb < 0) throw ERROR("Invalid limit in ") << file;
+  }
+  repeat = 0;
+  if(!strrepeat.empty()) {
+    repeat = strtol(strrepeat.c_str(), &end, 10);
+    if(*end || repeat < 0) throw ERROR("Invalid repeat in ") << file;
+  }
+
+  // size discovery for progress and scheduling, -1 = unknown (an empty file is 0)
+  size      = deviceSize(filename.c_str());
+  allocated = allocatedSize(filename.c_str());
+  if(limit_mb) {
+    size      = size >= 0      ? std::min(size, limit_mb*1048576)      : limit_mb*1048576;
+    allocated = allocated >= 0 ? std::min(allocated, limit_mb*1048576) : limit_mb*1048576;
+  }
 
   if(access(filename.c_str(), F_OK | R_OK)) {
     switch (errno) {
@@ -106,32 +133,9 @@ FileData::FileData(const string& file) {
   }
 }
 
-/*******************************************************************************
- * Usage (from external files)
- ******************************************************************************/
-
-const char * version_info  = 
-  "Copyright (C) 2018 Bart Sjerps <bart@dirty-cache.com>\n"
-  "License GPLv3+: GNU GPL version 3 or later <http://gnu.org/licenses/gpl.html>\n"
-  "This is free software: you are free to change and redistribute it.\n"
-  "There is NO WARRANTY, to the extent permitted by law.\n\n"
-  "build date: " __DATE__  "\nbuild time: " __TIME__ "\n";
-
-
-const char * title_info = " - The Quick & Dirty Dedupe Analyzer\n"
-  "Use for educational purposes only - actual array reduction results may vary\n";
-
-extern const char* manpage_head;
-extern const char* manpage_body;
-extern const char* bash_complete;
-
-void showtitle()    { if(!g_quiet) cout << "qdda " << PROGVERSION << title_info ; }
-void showversion()  { showtitle(); std::cout << version_info << std::endl; }
-void showcomplete() { std::cout << bash_complete; }
-
-/*******************************************************************************
- * Various
- ******************************************************************************/
+FileData::FileData() {
+  ifs=NULL; source=NULL; fsmap=NULL; ratio=0; limit_mb=0; bytes=0; size=-1; allocated=-1; repeat=0;
+}
 
 /*******************************************************************************
  * Notes on hash algorithm
@@ -161,14 +165,7 @@ void showcomplete() { std::cout << bash_complete; }
  ******************************************************************************/
 
 // returns the least significant 60 bits of the md5 hash (16 bytes) as 64-bit unsigned int
-uint64_t hash_md5(const char * src, char* zerobuf, const int size) {
-  unsigned char digest[16];
-  memset(zerobuf,0,size);                     // initialize buf with zeroes
-  if(memcmp (src,zerobuf,size)==0) return 0;  // return 0 for zero block
-  MD5_CTX ctx;  
-  MD5_Init(&ctx);
-  MD5_Update(&ctx, src, size);
-  MD5_Final(digest, &ctx);
+static uint64_t md5bits(const unsigned char* digest) {
   return                                   // ignore chars 0-8
     ((uint64_t)(digest[8]&0X0F)  << 56) +  // pick 4 bits from byte 7
     ((uint64_t)digest[9]  << 48) +         // all bits from byte 6 to 0
@@ -180,6 +177,17 @@ uint64_t hash_md5(const char * src, char* zerobuf, const int size) {
     ((uint64_t)digest[15]);
 }
 
+uint64_t hash_md5(const char * src, char* zerobuf, const int size) {
+  unsigned char digest[16];
+  memset(zerobuf,0,size);                     // initialize buf with zeroes
+  if(memcmp (src,zerobuf,size)==0) return 0;  // return 0 for zero block
+  MD5_CTX ctx;  
+  MD5_Init(&ctx);
+  MD5_Update(&ctx, src, size);
+  MD5_Final(digest, &ctx);
+  return md5bits(digest);
+}
+
 // dummy compress function
 u_int compress_none(const char * src, char* buf, const int size) { return size ; }
   
@@ -209,6 +217,112 @@ u_int compress_deflate(const char* src, char* buf, const int size) {
   return compressed;
 }
 
+/*******************************************************************************
+ * BlockKernel class functions
+ ******************************************************************************/
+
+BlockKernel::BlockKernel(int m, int blockbytes) {
+  method = m;
+  size   = blockbytes;
+  zs     = NULL;
+  buf    = new char[LZ4_compressBound(size)];
+  lz4    = LZ4_createStream(); // also for lz4size
+  if(!lz4) throw ERROR("Cannot allocate LZ4 stream");
+  if(method == Metadata::deflate) {
+    z_stream* strm = new z_stream;
+    strm->zalloc = Z_NULL;
+    strm->zfree  = Z_NULL;
+    strm->opaque = Z_NULL;
+    if(deflateInit(strm, 6) != Z_OK) { delete strm; throw ERROR("Cannot initialize deflate"); }
+    zs = strm;
+  }
+}
+
+BlockKernel::~BlockKernel() {
+  LZ4_freeStream((LZ4_stream_t*)lz4);
+  if(zs)  { deflateEnd((z_stream*)zs); delete (z_stream*)zs; }
+  delete[] buf;
+}
+
+// zero check without a zero buffer: if the first 16 bytes are zero and every
+// byte equals the one 16 bytes further, all bytes are zero
+static bool isZero(const char* p, int bytes) {
+  static const char zero[16] = {};
+  if(memcmp(p, zero, std::min(bytes, 16))) return false;
+  return bytes <= 16 || memcmp(p, p + 16, bytes - 16) == 0;
+}
+
+uint64 BlockKernel::process(const char* src, bool sample, int& bytes, uint64* sf) {
+  const int tiles = (size + ktile_size - 1) / ktile_size;
+  MD5_CTX ctx;
+  bool nonzero = false;
+  int  done    = 0;     // tiles hashed (and compressed)
+  bool full    = false; // compressed output reached the block size (incompressible)
+  int  lz4out  = 0;     // LZ4 bytes so far
+  z_stream* strm = (z_stream*)zs;
+  const bool lz4m = method == Metadata::lz4;
+  LZ4_stream_t* lz4s = lz4m && tiles > 1 ? (LZ4_stream_t*)lz4 : NULL; // single tile: one-shot LZ4
+  FeatureHash fh;
+
+  lz4last = -1;
+  MD5_Init(&ctx);
+  if(sample && lz4s) LZ4_resetStream(lz4s);
+  if(sample && strm) {
+    deflateReset(strm);
+    strm->next_out  = (unsigned char*)buf;
+    strm->avail_out = size;
+  }
+  for(int t=0; t<tiles; t++) {
+    if(!nonzero) { // leading zero tiles are only processed once we find data
+      if(isZero(src + t*ktile_size, std::min(ktile_size, size - t*ktile_size))) continue;
+      nonzero = true;
+    }
+    for(; done <= t; done++) {
+      const char* tile = src + done*ktile_size;
+      const int   n    = std::min(ktile_size, size - done*ktile_size);
+      MD5_Update(&ctx, tile, n);
+      if(sf) fh.update(tile, n);
+      if(sample && strm && !full) {
+        strm->next_in  = (unsigned char*)tile;
+        strm->avail_in = n;
+        deflate(strm, done == tiles-1 ? Z_FINISH : Z_NO_FLUSH);
+        full = strm->avail_out == 0;
+      }
+      for(int p=0; sample && lz4s && !full && p<n; p+=klz4_step) {
+        int r = LZ4_compress_fast_continue(lz4s, tile + p, buf + lz4out, std::min(klz4_step, n - p), size - lz4out, 1);
+        if(r <= 0) full = true;
+        else lz4out += r;
+      }
+    }
+  }
+  if(!nonzero) {
+    bytes = sample ? 0 : -1;
+    return 0;
+  }
+  if(!sample)     bytes = -1;
+  else if(lz4s)   bytes = full ? size : lz4out;
+  else if(lz4m)   { // single tile, same as compress_lz4 but reuses the state
+    int r = LZ4_compress_fast_extState(lz4, src, buf, size, size, 1);
+    bytes = (r <= 0 || r > size) ? size : r;
+    if(r > 0) lz4last = r;
+  }
+  else if(strm)   bytes = full ? size : strm->total_out;
+  else            bytes = size;
+
+  if(sf) fh.final(sf);
+
+  unsigned char digest[16];
+  MD5_Final(digest, &ctx);
+  return md5bits(digest);
+}
+
+// same as LZ4_compress_default, the result of process is reused if it was one-shot
+int BlockKernel::lz4size(const char* src) {
+  if(lz4last >= 0) return lz4last;
+  int r = LZ4_compress_fast_extState(lz4, src, buf, size, LZ4_compressBound(size), 1);
+  return lz4last = (r <= 0 ? size : r);
+}
+
 /*******************************************************************************
  * Formatting & printing
  ******************************************************************************/
@@ -257,229 +371,6 @@ void progress(int64 blocks,int64 blocksize, size_t bytes, const char * msg) {
   prevbytes=bytes; // save byte count for next call
 }
 
-/*******************************************************************************
- * Functions
- ******************************************************************************/
-
-// Import another database
-void import(QddaDB& db, const string& filename) {
-  if(!Database::isValid(filename.c_str())) return;
-  QddaDB idb(filename);
-  int64 blocksize = db.getblocksize();
-  if(blocksize != idb.getblocksize()) throw ERROR("Incompatible blocksize on") << filename;
-  cout << "Adding " << idb.getrows() << " blocks from " << filename << " to " << db.getrows() << " existing blocks" << endl;
-  db.import(filename);
-}
-
-// Merge staging data into kv table, track & display time to merge
-void merge(QddaDB& db, Parameters& parameters) {
-  if(!Database::isValid(parameters.stagingname.c_str())) return;
-  
-  StagingDB sdb(parameters.stagingname);
-
-  sql_int blocksize    = db.getblocksize();
-  sql_int dbrows       = db.getrows();
-  sql_int tmprows      = sdb.getrows();
-  sql_int mib_staging  = tmprows*blocksize/1024;
-  sql_int mib_database = dbrows*blocksize/1024;
-  sql_int fsize1       = db.filesize();
-  sql_int fsize2       = sdb.filesize();
-
-  if(blocksize != sdb.blocksize()) throw ERROR("Incompatible blocksize on stagingdb");
-  
-  sdb.close();
-
-  Stopwatch stopwatch;
-  if(tmprows) { // do nothing if merge db has no rows
-    if(!g_quiet) cout 
-      << "Merging " << tmprows << " blocks (" 
-      << mib_staging << " MiB) with " 
-      << dbrows << " blocks (" 
-      << mib_database << " MiB)" << flush;
-
-    stopwatch.reset();
-    uint64 index_rps = tmprows*1000000/stopwatch;
-    uint64 index_mbps = mib_staging*1000000/stopwatch;
-    
-    stopwatch.reset();
-    db.merge(parameters.stagingname);
-    stopwatch.lap();
-    
-    auto time_merge = stopwatch;
-    uint64 merge_rps = (tmprows+dbrows)*1000000/time_merge;
-    uint64 merge_mbps = (mib_staging+mib_database)*1000000/time_merge;
-    if(!g_quiet) cout << " in "
-      << stopwatch.seconds() << " sec (" 
-      << merge_rps << " blocks/s, " 
-      << merge_mbps << " MiB/s)" << endl;
-  }
-  Database::deletedb(parameters.stagingname);
-}
-
-// test hashing, compression and insert performance
-void cputest(QddaDB& db, Parameters& p) {
-
-  StagingDB::createdb(p.stagingname,db.getblocksize());
-  StagingDB stagingdb(p.stagingname);
-  
-  const int64 mib       = 1024; // size of test set
-  const int64 blocksize = db.getblocksize();
-
-  const int64 rows      = mib * 1024 / blocksize;
-  const int64 bufsize   = mib * 1024 * 1024;
-  char*       testdata  = new char[bufsize];
-  uint64*     hashes    = new uint64[rows];
-  int64*      bytes     = new int64[rows];
-  int64 time_hash, time_compress, time_insert;
-  char buf[blocksize*1024];
-  
-  Stopwatch   stopwatch;
-  
-  cout << std::fixed << setprecision(2) << "*** Synthetic performance test, 1 thread ***" << endl;
-
-  cout << "Initializing:" << flush;
-  srand(1);
-  memset(testdata,0,bufsize);
-  for(int64 i=0;i<bufsize;i++) testdata[i] = (char)rand() % 8; // fill test buffer with random(ish) but compressible data
-  cout << setw(15) << rows << " blocks, " << blocksize << "k (" << bufsize/1048576 << " MiB)" << endl;
-
-  cout << left << setw(18) << "Hashing:" << flush;
-  stopwatch.reset();
-  for(int64 i=0;i<rows;i++) hashes[i] = hash_md5(testdata + i*blocksize*1024,buf,blocksize*1024);
-  time_hash = stopwatch.lap();
-  
-  cout << setw(15) << time_hash     << " usec, " 
-       << setw(10) << (float)bufsize/time_hash << " MB/s, " 
-       << setw(11) << (float)rows*1000000/time_hash << " rows/s"
-       << endl;
-
-  cout << left << setw(18) << "Compress DEFLATE:" << flush;
-  stopwatch.reset();
-  
-  for(int64 i=0;i<rows;i++) bytes[i] = compress_deflate(testdata + i*blocksize*1024,buf,blocksize*1024);
-  time_compress = stopwatch.lap();
-  cout << setw(15) << time_compress << " usec, " 
-       << setw(10) << (float)bufsize/time_compress << " MB/s, " 
-       << setw(11) << (float)rows*1000000/time_compress << " rows/s"
-       << endl;
-
-  cout<< left << setw(18) << "Compress LZ4:" << flush;
-  stopwatch.reset();
-
-  for(int64 i=0;i<rows;i++) bytes[i] = compress_lz4(testdata + i*blocksize*1024,buf,blocksize*1024);
-  time_compress = stopwatch.lap();
-  cout << setw(15) << time_compress << " usec, " 
-       << setw(10) << (float)bufsize/time_compress << " MB/s, " 
-       << setw(11) << (float)rows*1000000/time_compress << " rows/s"
-       << endl;
-
-
-  cout << left << setw(18) << "DB insert:" << flush;
-  stopwatch.reset();
-
-  stagingdb.begin();
-  for(int64 i=0;i<rows;i++) stagingdb.insertdata(hashes[i],bytes[i]);
-  stagingdb.end();
-  time_insert = stopwatch.lap();
-  cout << setw(15) << time_insert << " usec, "
-       << setw(10) << (float)bufsize/time_insert   << " MB/s, "
-       << setw(11) << (float)rows*1000000/time_insert << " rows/s"
-       << endl;
-
-  delete[] testdata;
-  delete[] hashes;
-  delete[] bytes;
-  Database::deletedb(p.stagingname);
-}
-
-// Run man command with generated man page text
-void manpage() {
-  string cmd = "(";
-  cmd += whoAmI();
-  cmd += " --mandump > /tmp/qdda.1 ; man /tmp/qdda.1 ; rm /tmp/qdda.1 )";
-  if(!system(cmd.c_str())) { };
-}
-
-// Return default database path
-const string& defaultDbName() {
-  static string dbname;
-  dbname = homeDir() + "/qdda.db";
-  return dbname;
-}
-
-// show short help
-void showhelp(LongOptions& lo) {
-  std::cout << "\nUsage: qdda <options> [FILE]...\nOptions:" << "\n";
-  lo.printhelp(cout);
-  std::cout << "\nMore info: qdda --man \nor the project homepage: https://wiki.dirty-cache.com/qdda\n\n";
-}
-
-// dump manpage to stdout
-void mandump(LongOptions& lo) {
-  cout << manpage_head;
-  lo.printman(cout);
-  cout << manpage_body;
-}
-
-// call self with demo parameters
-void rundemo() {
-  string cmd = "";
-  cmd += whoAmI();
-  cmd += " -d /tmp/demo compress:128,4 compress:256,2 compress:512 zero:512";
-  cout << "Running: " << cmd << endl << endl;
-  if(!system(cmd.c_str())) { };
-}
-
-// find offsets for a given hash
-void findhash(Parameters& parameters, uint64 searchhash) {
-  StagingDB db(parameters.stagingname);
-  IntArray tabs;
-  tabs << 20 << 20 << 10 << 10;
-  Query findhash(db,"select * from offsets where hash=?");
-  findhash.bind(searchhash);
-  findhash.report(cout,tabs);
-}
-
-// find N hashes with highest dupcount
-void tophash(QddaDB& db, int amount = 10) {
-  Query tophash(db,"select hash,blocks from kv where hash!=0 and blocks>1 order by blocks desc limit ?");
-  IntArray tabs;
-  tabs << 20 << 10;
-  tophash.bind(amount);
-  tophash.report(cout,tabs);
-}
-
-// update sum tables
-void update(QddaDB& db) {
-  db.update();
-}
-
-// safety guards against overwriting existing files or devices by SQLite
-void ParseFileName(string& name) {
-  char buf[160];
-  if(!getcwd(buf, 160)) throw ERROR("Get current directory failed");
-  string cwd = buf;
-  if(name.empty()) name = homeDir() + "/qdda.db";
-  if(name[0] != '/') name = cwd + "/" + name;
-  while (name.find("//") < string::npos) {
-    auto i=name.find("//");
-    name.replace(i,2,"/");
-  }
-  if (!name.compare(0,4,"/dev")  )   throw ERROR("/dev not allowed in filename: " ) << name;
-  if (!name.compare(0,5,"/proc") )   throw ERROR("/proc not allowed in filename: ") << name;
-  if (!name.compare(0,4,"/sys")  )   throw ERROR("/sys not allowed in filename: " ) << name;
-  if (!name.find_last_of("/\\"))     throw ERROR("root dir not allowed: "         ) << name;
-  if(name.find(".db")>name.length()) name += ".db";
-}
-
-// Return name for staging database - same dir as main database
-string genStagingName(string& name) {
-  string tmpname;
-  tmpname = name.substr(0,name.find(".db"));
-  tmpname += "-staging.db";
-  return tmpname;
-}
-
 /*******************************************************************************
  * Metadata class functions
  ******************************************************************************/
@@ -586,127 +477,3 @@ void Metadata::setInterval(int p1) {
     throw ERROR("Invalid compression interval: ") << p1;
   }
 }
-
-/*******************************************************************************
- * Main section - process options etc
- ******************************************************************************/
-
-int main(int argc, char** argv) {
-  Parameters  parameters = {};
-  Options     opts = {};
-  Metadata    metadata;
-
-  // set default values
-  parameters.workers   = cpuCount();
-  parameters.readers   = kmax_reader_threads;
-  parameters.bandwidth = kdefault_bandwidth;
-
-  Parameters& p = parameters; // shorthand alias
-  Options& o = opts;
-
-  try {
-    LongOptions opts;
-    opts.add("version"  ,'V', ""             , showversion,  "show version and copyright info");
-    opts.add("help"     ,'h', ""             , o.do_help,    "show usage");
-    opts.add("man"      ,'m', ""             , manpage,      "show detailed manpage");
-    opts.add("db"       ,'d', "<file>"       , o.dbname,     "database file path (default $HOME/qdda.db)");
-    opts.add("append"   ,'a', ""             , o.append,     "Append data instead of deleting database");
-    opts.add("delete"   , 0 , ""             , o.do_delete,  "Delete database");
-    opts.add("quiet"    ,'q', ""             , g_quiet,      "Don't show progress indicator or intermediate results");
-    opts.add("bandwidth",'b', "<mb/s>"       , p.bandwidth,  "Throttle bandwidth in MB/s (default 200, 0=disable)");
-    opts.add("array"    , 0 , "<list|array>" , o.array,      "show/set arraytype or custom (see man page section STORAGE ARRAYS)");
-    opts.add("compress" , 0 , "<method>"     , o.compress,   "set compression method <none|lz4|deflate>[:interval]");
-    opts.add("detail"   ,'x', ""             , o.detail,     "Detailed report (file info and dedupe/compression histograms)");
-    opts.add("dryrun"   ,'n', ""             , p.dryrun,     "skip staging db updates during scan");
-    opts.add("purge"    , 0 , ""             , o.do_purge,   "Reclaim unused space in database (sqlite vacuum)");
-    opts.add("import"   , 0 , "<file>"       , o.import,     "import another database (must have compatible metadata)");
-    opts.add("cputest"  , 0 , ""             , o.do_cputest, "Single thread CPU performance test");
-    opts.add("nomerge"  , 0 , ""             , p.skip,       "Skip staging data merge and reporting, keep staging database");
-    opts.add("debug"    , 0 , ""             , g_debug,      "Enable debug output");
-    opts.add("queries"  , 0 , ""             , g_query,      "Show SQLite queries and results");
-    opts.add("tmpdir"   , 0 , "<dir>"        , p.tmpdir,     "Set $SQLITE_TMPDIR for temporary files");
-    opts.add("workers"  , 0 , "<wthreads>"   , p.workers,    "number of worker threads");
-    opts.add("readers"  , 0 , "<rthreads>"   , p.readers,    "(max) number of reader threads");
-    opts.add("findhash" , 0 , "<hash>"       , o.shash,      "find blocks with hash=<hash> in staging db");
-    opts.add("tophash"  , 0 , "<num>"        , o.tophash,    "show top <num> hashes by refcount");
-    opts.add("squash"   , 0 , ""             , o.squash,     "set all refcounts to 1");
-    opts.add("mandump"  , 0 , ""             , o.do_mandump, "dump raw manpage to stdout");
-    opts.add("bashdump" , 0 , ""             , o.do_bashdump,"dump bash_completion script to stdout");
-    opts.add("demo"     , 0 , ""             , rundemo,      "show quick demo");
-#ifdef __DEBUG
-    opts.add("update"   , 0 , ""             , o.do_update,  "update temp tables (debug only!)");
-    opts.add("buffers"  , 0 , "<buffers>"    , p.buffers,    "number of buffers (debug only!)");
-#endif
-
-    int rc=opts.parse(argc,argv);
-    if(rc) return 0; // opts.parse executed a message function
-    
-    if(o.do_help)          { showhelp(opts); return 0; }
-    else if(o.do_mandump)  { mandump(opts); return 0; }
-    else if(o.do_bashdump) { showcomplete(); return 0; }
-
-    if(!p.tmpdir.empty()) setenv("SQLITE_TMPDIR",p.tmpdir.c_str(),1);
-  
-    showtitle();
-    ParseFileName(o.dbname);
-    p.stagingname = genStagingName(o.dbname);
-    
-    if(o.do_delete)  {
-      if(!g_quiet) cout << "Deleting database " << o.dbname << endl;
-      Database::deletedb(o.dbname); return 0;
-    }
-    if(o.array.size()>0) { if(metadata.setArray(o.array)) return 0; }
-    if(!o.compress.empty()) metadata.setMethod(o.compress);
-  }
-  catch (Fatal& e) { e.print(); return 10; }
-
-
-  v_FileData filelist;
-
-  try {
-    // Build filelist
-    if(optind<argc || !isatty(fileno(stdin)) ) {
-      if (!isatty(fileno(stdin)))
-        filelist.push_back(FileData("/dev/stdin"));
-      for (int i = optind; i < argc; ++i)
-        filelist.push_back(FileData(argv[i]));
-      if(!o.append) { // not appending -> delete old database
-        if(!g_quiet) cout << "Creating new database " << o.dbname << endl;
-        Database::deletedb(o.dbname);
-        QddaDB::createdb(o.dbname);
-      }
-    }
-    if(o.do_cputest && !o.append) {
-      if(!g_quiet) cout << "Creating new database " << o.dbname << endl;
-      Database::deletedb(o.dbname);
-      QddaDB::createdb(o.dbname);
-    }
-    if(!Database::exists(o.dbname)) QddaDB::createdb(o.dbname);
-    QddaDB db(o.dbname);
-
-    db.setmetadata(metadata.getBlocksize(), metadata.getMethod(), metadata.getInterval(), metadata.getArray(), metadata.getBuckets());
-
-    if(filelist.size()>0) 
-      analyze(filelist, db, parameters);
-
-    if(g_abort) return 1;
-
-    if     (o.do_purge)        { db.vacuum();            }
-    else if(!o.import.empty()) { import(db,o.import);    }
-    else if(o.do_cputest)      { cputest(db,p) ;         }
-    else if(o.do_update)       { update(db) ;            }
-    else if(o.shash!=0)        { findhash(p, o.shash);   }
-    else if(o.tophash!=0)      { tophash(db, o.tophash); }
-    else if(o.squash)          { db.squash();            }
-    else {
-      if(!parameters.skip)     { merge(db,parameters); }
-      if(o.detail)             { reportDetail(db); }
-      else if (!p.skip)        { report(db); }
-    }
-  }
-  catch (std::bad_alloc& e) { ERROR("Out of memory").print(); return -1; }
-  catch (Fatal& e) { e.print(); return -1; }
-
-  return 0;  
-}
-
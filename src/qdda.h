@@ -14,6 +14,8 @@
 
 class FileData;
 class Parameters;
+class BlockSource;
+class FsMap;
 
 typedef std::vector<FileData> v_FileData;
 typedef BoundedVal<int,1,128> Blocksize;
@@ -29,10 +31,51 @@ u_int compress_none(const char * src,char * buf, const int size);
 u_int compress_lz4(const char * src,char * buf, const int size);
 u_int compress_deflate(const char * src,char * buf, const int size);
 
+/*******************************************************************************
+ * BlockKernel class - fused zero check, MD5 and compression of a block
+ * The separate functions above each stream the whole block through the cache,
+ * at large blocksizes (128K) the block is mostly evicted from L1/L2 before the
+ * next pass. The kernel processes the block in tiles of ktile_size: each tile
+ * is checked for zeroes, added to the MD5 and fed to the compressor while it is
+ * still in the L1/L2 cache. LZ4 streams each tile in steps of klz4_step, as
+ * LZ4 1.8.2 resets the stream history for inputs >= 4K (1.8.3 and later can
+ * take the whole tile). Blocks of one tile use one-shot LZ4, their results are
+ * the same as compress_lz4. Larger blocks compress about 1% worse (a step ends
+ * with literals), MD5 and deflate results are the same as hash_md5/compress_xxx.
+ * With --delta the super-features are calculated in the same tile loop, and
+ * lz4size gives the one-shot LZ4 size for the delta estimates.
+ * One kernel per worker thread (holds compressor state).
+ ******************************************************************************/
+
+const int ktile_size = 16384;
+const int klz4_step  = 4095;  // below the LZ4 1.8.2 history reset
+
+class BlockKernel {
+public:
+  BlockKernel(int method, int blockbytes);
+ ~BlockKernel();
+  // returns the hash (0 = zero block), bytes = compressed size or -1 if not sampled
+  // sf = super-features (kdelta_sfs) of non-zero blocks, NULL = not needed
+  uint64 process(const char* src, bool sample, int& bytes, uint64* sf = NULL);
+  int    lz4size(const char* src); // one-shot LZ4 size of the last processed block
+private:
+  BlockKernel(const BlockKernel&) = delete;
+  int   method;
+  int   size;    // block size in bytes
+  int   lz4last; // one-shot LZ4 size of the last block, -1 if not calculated
+  void* lz4;     // LZ4_stream_t
+  void* zs;      // z_stream
+  char* buf;     // compressor output
+};
+
 void analyze(v_FileData& filelist, QddaDB& db, Parameters& parameters);
 
 void report(QddaDB& db);
 void reportDetail(QddaDB& db);
+void reportOverlap(QddaDB& db);
+void reportExtents(QddaDB& db);
+void reportDiff(QddaDB& db, QddaDB& olddb);
+void reportGroups(QddaDB& db, const std::string& spec);
 
 // show repeating progress line
 void  progress(int64 blocks,int64 blocksize, size_t bytes, const char * msg = NULL);
@@ -77,9 +120,17 @@ private:
 class FileData {
 public:
   explicit FileData(const std::string& name);
+  FileData();              // placeholder, file is not opened (replay, library streams)
   std::ifstream* ifs;      // opened stream
+  BlockSource*   source;   // zero-copy data source (library), NULL if not used
+  FsMap*         fsmap;    // filesystem free space (--fsaware), NULL = read all blocks
   std::string    filename; // original file name
+  std::string    tag;      // group tag (file@tag), empty = default (--tag)
   int64          limit_mb; // Stop scanning after x MiB (testing) 0 = read to end
+  int64          bytes;    // bytes scanned
+  int64          size;     // bytes to be scanned (limited by limit_mb), -1 = unknown (pipe etc)
+  int64          allocated;// same but without holes (sparse files), used for scheduling
+  std::vector<std::pair<int64,int64>> ranges; // offset, length (bytes) to read in ascending order, empty = whole file (--trickle)
   int            repeat;   // Simulate multiple scans (demo/testing) normal = 1
   bool           ratio;    // Simulate compression ratio, default = 0
 };
@@ -100,6 +151,9 @@ struct Options {
   bool squash;
   bool append;
   bool detail;
+  bool overlap;
+  bool extents;
+  bool dropcache;
 
   int   tophash;
   int64 shash;
@@ -107,6 +161,11 @@ struct Options {
   std::string dbname;
   std::string compress;
   std::string import;
+  std::string diff;
+  std::string query;
+  std::string metrics;
+  std::string groups;
+  std::string trickle;
 };
 
 /*******************************************************************************
@@ -116,14 +175,20 @@ struct Parameters {
 
   std::string stagingname;
   std::string tmpdir;
+  std::string tracefile; // write hash trace to this file
+  std::string replay;    // replay hash trace instead of reading files
+  std::string tag;       // default group tag for scanned files
 
   int bandwidth; // default bandwidth throttle (MB/s)
   int workers;   // number of workers (threads)
   int readers;   // max number of readers
   int buffers;   // override read buffers
+  int extent;    // extent size (MiB) for extent statistics
 
   bool queries;  // show sqlite queries 
   bool skip;     // skip merge, keep staging database
   bool dryrun;   // don't update staging database
+  bool fsaware;  // skip unallocated filesystem blocks
+  bool delta;    // detect similar blocks (delta compression estimate)
 };
 
@@ -0,0 +1,168 @@
+/*******************************************************************************
+ * Title       : sketch.cpp
+ * Description : Probabilistic data sketches for qdda
+ * Author      : Bart Sjerps <bart@dirty-cache.com>
+ * License     : GPLv3+
+ * Disclaimer  : See https://www.gnu.org/licenses/gpl-3.0.txt
+ * More info   : https://wiki.dirty-cache.com/qdda
+ ******************************************************************************/
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <set>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+#include "tools.h"
+#include "sketch.h"
+
+const double khash_space = 1152921504606846976.0; // 2^60, range of truncated MD5 hashes
+
+/*******************************************************************************
+ * BottomK class functions
+ ******************************************************************************/
+
+// add a hash, only keep it if it is one of the k smallest
+void BottomK::add(uint64 hash) {
+  if(hash==0) return; // zero blocks are not data
+  if(hashes.size() >= ksketch_size) {
+    auto last = --hashes.end();
+    if(hash >= *last) return; // most hashes end here once the sketch is full
+    if(!hashes.insert(hash).second) return;
+    hashes.erase(--hashes.end());
+  } else {
+    hashes.insert(hash);
+  }
+}
+
+void BottomK::merge(const BottomK& other) {
+  for(auto it = other.hashes.begin(); it != other.hashes.end(); ++it) add(*it);
+}
+
+// if the sketch is not full it holds all distinct hashes, else the k-th smallest
+// hash tells us how densely the hash space is populated
+double BottomK::distinct() const {
+  if(hashes.size() < ksketch_size) return hashes.size();
+  return (ksketch_size - 1) * khash_space / (*hashes.rbegin() + 1.0);
+}
+
+// Jaccard estimate: the fraction of the bottom-k of the union that is in both sets
+// walks both sorted sketches in one pass, no copies required
+double BottomK::jaccard(const BottomK& other) const {
+  uint64 kth;
+  int both = unionstats(other, kth);
+  int size = std::min(ksketch_size, (int)unionsize(other));
+  return size ? (double)both / size : 0;
+}
+
+double BottomK::shared(const BottomK& other) const {
+  uint64 kth;
+  int both = unionstats(other, kth);
+  size_t size = unionsize(other);
+  if(size < ksketch_size) return both; // both sketches complete, exact count
+  return both * (ksketch_size - 1) * khash_space / (kth + 1.0) / ksketch_size;
+}
+
+// number of distinct hashes in both sketches combined (at most 2*k)
+size_t BottomK::unionsize(const BottomK& other) const {
+  size_t n = 0;
+  auto a = hashes.begin(), b = other.hashes.begin();
+  while(a != hashes.end() || b != other.hashes.end()) {
+    if(b == other.hashes.end() || (a != hashes.end() && *a < *b)) ++a;
+    else if(a == hashes.end() || *b < *a) ++b;
+    else { ++a; ++b; }
+    n++;
+  }
+  return n;
+}
+
+// count hashes within the bottom-k of the union that are in both sketches, kth = largest hash of that bottom-k
+int BottomK::unionstats(const BottomK& other, uint64& kth) const {
+  int n = 0, both = 0;
+  kth = 0;
+  auto a = hashes.begin(), b = other.hashes.begin();
+  while(n < ksketch_size && (a != hashes.end() || b != other.hashes.end())) {
+    if(b == other.hashes.end() || (a != hashes.end() && *a < *b)) kth = *a++;
+    else if(a == hashes.end() || *b < *a) kth = *b++;
+    else { kth = *a++; ++b; both++; }
+    n++;
+  }
+  return both;
+}
+
+// blob format: array of 64-bit little-endian hashes in ascending order
+const std::string BottomK::serialize() const {
+  std::string blob;
+  blob.reserve(hashes.size() * 8);
+  for(auto it = hashes.begin(); it != hashes.end(); ++it)
+    for(int i=0; i<8; i++) blob += (char)((*it >> (8*i)) & 0xFF);
+  return blob;
+}
+
+void BottomK::load(const std::string& blob) {
+  hashes.clear();
+  for(size_t n=0; n+8 <= blob.size(); n+=8) {
+    uint64 hash = 0;
+    for(int i=0; i<8; i++) hash |= (uint64)(unsigned char)blob[n+i] << (8*i);
+    add(hash);
+  }
+}
+
+/*******************************************************************************
+ * BloomFilter class functions
+ ******************************************************************************/
+
+BloomFilter::BloomFilter()  { bits = new unsigned char[(1UL << kbloom_bits)/8](); }
+BloomFilter::~BloomFilter() { delete[] bits; }
+
+// the hash is already uniformly distributed so we derive the probes from its bits
+// (double hashing: probe i = h1 + i*h2)
+bool BloomFilter::testset(uint64 hash) {
+  const uint64 mask = (1UL << kbloom_bits) - 1;
+  uint64 h1 = hash & mask;
+  uint64 h2 = ((hash >> kbloom_bits) & mask) | 1;
+  bool found = true;
+  for(int i=0; i<3; i++) {
+    uint64 bit = (h1 + i*h2) & mask;
+    unsigned char b = 1 << (bit & 7);
+    if(!(bits[bit>>3] & b)) { found = false; bits[bit>>3] |= b; }
+  }
+  return found;
+}
+
+/*******************************************************************************
+ * HyperLogLog class functions
+ ******************************************************************************/
+
+HyperLogLog::HyperLogLog() {
+  for(int i=0; i < (1 << khll_bits); i++) regs[i].store(0, std::memory_order_relaxed);
+}
+
+// the low bits select the register, the rank is the position of the first 1 bit
+// in the remaining (60 - khll_bits) bits of the hash
+void HyperLogLog::add(uint64 hash) {
+  if(hash==0) return;
+  const int mask = (1 << khll_bits) - 1;
+  uint64 w = hash >> khll_bits;
+  unsigned char rank = w ? __builtin_ctzll(w) + 1 : 60 - khll_bits + 1;
+  std::atomic<unsigned char>& reg = regs[hash & mask];
+  unsigned char cur = reg.load(std::memory_order_relaxed);
+  while(rank > cur && !reg.compare_exchange_weak(cur, rank, std::memory_order_relaxed));
+}
+
+// raw HLL estimate, linear counting for small sets
+double HyperLogLog::estimate() const {
+  const double m = 1 << khll_bits;
+  double sum = 0;
+  int empty = 0;
+  for(int i=0; i < (1 << khll_bits); i++) {
+    int r = regs[i].load(std::memory_order_relaxed);
+    sum += ldexp(1.0, -r);
+    if(!r) empty++;
+  }
+  double e = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+  if(e <= 2.5 * m && empty) e = m * log(m / empty);
+  return e;
+}
@@ -0,0 +1,84 @@
+/*******************************************************************************
+ * Title       : sketch.h
+ * Description : header file for sketch.cpp - probabilistic data sketches
+ * Author      : Bart Sjerps <bart@dirty-cache.com>
+ * License     : GPLv3+, https://www.gnu.org/licenses/gpl-3.0.txt
+ * Disclaimer  : GPLv3+
+ * URL         : https://wiki.dirty-cache.com/qdda
+ ******************************************************************************/
+
+#pragma once
+
+#include <set>
+#include <string>
+#include <atomic>
+
+#include "tools.h"
+
+const int ksketch_size = 1024; // max number of hashes kept per bottom-k sketch
+
+/*******************************************************************************
+ * BottomK class - bottom-k (MinHash) sketch of a set of block hashes
+ * Keeps only the k smallest distinct hashes of a set. As block hashes are
+ * (truncated) MD5 sums, they are uniformly distributed over 60 bits which makes
+ * the k smallest hashes a random sample of the distinct hashes in the set.
+ * Used to estimate distinct block counts and the overlap between files
+ * without keeping per-file hash lists.
+ ******************************************************************************/
+
+class BottomK {
+public:
+  BottomK() {}
+  void   add(uint64 hash);                    // add a hash to the sketch (ignores zero blocks)
+  void   merge(const BottomK& other);         // add all hashes from another sketch
+  size_t size() const { return hashes.size(); }
+  double distinct() const;                    // estimated number of distinct hashes
+  double jaccard(const BottomK& other) const; // estimated Jaccard similarity |A^B|/|AvB|
+  double shared(const BottomK& other) const;  // estimated number of distinct hashes in both
+  const std::string serialize() const;        // pack hashes into blob
+  void   load(const std::string& blob);       // unpack hashes from blob
+  const std::set<uint64>& gethashes() const { return hashes; }
+private:
+  size_t unionsize(const BottomK& other) const;
+  int    unionstats(const BottomK& other, uint64& kth) const;
+  std::set<uint64> hashes;                    // sorted, at most ksketch_size entries
+};
+
+/*******************************************************************************
+ * BloomFilter class - fixed size set membership test for block hashes
+ * May report false positives (a hash seen before that was not), never false
+ * negatives. With kbloom_bits and 3 probes, the false positive rate stays
+ * below ~3% up to 2^kbloom_bits/8 (32M) hashes.
+ ******************************************************************************/
+
+const int kbloom_bits = 28; // 2^28 bits = 32 MiB
+
+class BloomFilter {
+public:
+  BloomFilter();
+ ~BloomFilter();
+  bool testset(uint64 hash);  // add hash, returns true if it was (probably) already present
+private:
+  BloomFilter(const BloomFilter&) = delete;
+  unsigned char* bits;
+};
+
+/*******************************************************************************
+ * HyperLogLog class - streaming distinct count estimate of block hashes
+ * Registers are atomic so all workers can add hashes without locking. Each
+ * register only ever increases so a compare-and-swap loop is sufficient, most
+ * hashes only need one (relaxed) load. Standard error is 1.04/sqrt(2^khll_bits)
+ * (0.8%), memory is 2^khll_bits bytes.
+ ******************************************************************************/
+
+const int khll_bits = 14;
+
+class HyperLogLog {
+public:
+  HyperLogLog();
+  void   add(uint64 hash);    // add a hash (ignores zero blocks)
+  double estimate() const;    // estimated number of distinct hashes
+private:
+  HyperLogLog(const HyperLogLog&) = delete;
+  std::atomic<unsigned char> regs[1 << khll_bits];
+};
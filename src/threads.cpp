@@ -13,6 +13,10 @@
 #include <thread>
 #include <string>
 #include <mutex>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <algorithm>
 
 #include <unistd.h>
 #include <sys/types.h>
@@ -22,7 +26,12 @@
 #include "tools.h"
 #include "database.h"
 #include "qdda.h"
+#include "sketch.h"
+#include "trace.h"
+#include "libqdda.h"
 #include "threads.h"
+#include "fsmap.h"
+#include "delta.h"
 
 using std::cout;
 using std::cerr;
@@ -32,7 +41,7 @@ using std::flush;
 
 extern bool g_debug;
 extern bool g_quiet;
-extern bool g_abort;
+extern std::ofstream c_metrics;
 
 const int kextra_buffers = 32;
 const size_t kbufsize    = 1024;
@@ -64,11 +73,18 @@ DataBuffer::DataBuffer(int64 blocksize, int64 sz_blocks) {
   blockbytes  = blocksize * 1024;
   bufsize     = blockbytes * blocks;
   readbuf     = new char[bufsize]();
+  data        = readbuf;
+  chunk       = NULL;
   used        = 0;
+  file        = 0;
+  offset      = 0;
+  precomputed = false;
   blockcount  = 0;
   bytes       = 0;
   v_hash.resize(blocks);
   v_bytes.resize(blocks);
+  v_sf.resize(blocks * kdelta_sfs);
+  v_lz4.resize(blocks);
 }
 
 DataBuffer::~DataBuffer() { delete[] readbuf; }
@@ -76,7 +92,14 @@ void DataBuffer::reset()  { used = 0; }
 
 // access to the nth block in the buffer - TBD: range checking!
 char* DataBuffer::operator[](int n) {
-  return readbuf + (n*blockbytes);
+  return (char*)data + (n*blockbytes);
+}
+
+void SourceChunk::release() {
+  if(--parts == 0) {
+    source->done(data);
+    delete this;
+  }
 }
 
 /*******************************************************************************
@@ -96,11 +119,37 @@ void IOThrottle::request(int64 kb) {
   stopwatch.reset();
 }
 
+/*******************************************************************************
+ * Eta class - estimated time to complete
+ ******************************************************************************/
+
+const double keta_smooth = 0.2; // weight of the latest throughput sample
+
+int64 Eta::update(int64 done, int64 total) {
+  if(!total) return -1;
+  if(done >= total) return 0;
+  if(!started) { // start timing when the first data arrives, not when we are created
+    if(!done) return -1;
+    started = true;
+    stopwatch.reset();
+    prevbytes = done;
+    return -1;
+  }
+  int64 now = stopwatch.lap();
+  if(now - prevtime >= 1000000) {
+    double cur = (done - prevbytes) * 1000000.0 / (now - prevtime);
+    rate = rate ? keta_smooth * cur + (1 - keta_smooth) * rate : cur;
+    prevtime  = now;
+    prevbytes = done;
+  }
+  return rate > 0 ? (total - done) / rate : -1;
+}
+
 /*******************************************************************************
  * Ringbuffer class - Keeps track of multiple buffers between threads
  ******************************************************************************/
 
-RingBuffer::RingBuffer(size_t sz) {
+RingBuffer::RingBuffer(size_t sz, const std::atomic<bool>& st): stop(st) {
   head = 0;
   tail = 0;
   work = 0;
@@ -136,6 +185,8 @@ bool RingBuffer::isEmpty() {
   return tail == work;
 }
 
+bool RingBuffer::aborted() { return stop || g_abort; }
+
 bool RingBuffer::isDone() {
   Lockguard lock(mx_meta);
   if(done) {
@@ -145,13 +196,13 @@ bool RingBuffer::isDone() {
 }
 
 int RingBuffer::getfree(size_t& ix) {
-  if(g_abort) return 2;
+  if(aborted()) return 2;
   Lockguard lock(headbusy);
   ix = head;
   while (isFull()) {
     usleep(10000);
     if(isDone()) return 1;
-    if(g_abort) return 2;
+    if(aborted()) return 2;
   }
   mx_buffer[ix].lock();
   head = ++head % size; // move head to the next  
@@ -159,13 +210,13 @@ int RingBuffer::getfree(size_t& ix) {
 }
 
 int RingBuffer::getfull(size_t& ix) {
-  if(g_abort) return 2;
+  if(aborted()) return 2;
   Lockguard lock(workbusy);
   ix = work;
   while(!hasData()) {
     usleep(10000);
     if(isDone()) return 1;
-    if(g_abort) return 2;
+    if(aborted()) return 2;
   }
   mx_buffer[ix].lock();
   work = ++work % size;  // move ptr to next
@@ -173,13 +224,13 @@ int RingBuffer::getfull(size_t& ix) {
 }
 
 int RingBuffer::getused(size_t& ix) {
-  if(g_abort) return 2;
+  if(aborted()) return 2;
   Lockguard lock(tailbusy);
   ix = tail;
   while (isEmpty()) {
     usleep(10000);
     if(isDone()) return 1;
-    if(g_abort) return 2;
+    if(aborted()) return 2;
   }
   mx_buffer[ix].lock();
   tail = ++tail % size;  // we need the next
@@ -191,13 +242,16 @@ int RingBuffer::getused(size_t& ix) {
  ******************************************************************************/
 
 SharedData::SharedData(int buffers, int files, int64 blksz, StagingDB* db, int bw): 
-  throttle(bw), rb(buffers)
+  stop(false), throttle(bw), rb(buffers, stop)
 {
   blocksize      = blksz;
   blockspercycle = kbufsize / blocksize; // read 1MiB per IO
   blocks         = 0;
   bytes          = 0;
   cbytes         = 0;
+  totalbytes     = 0;
+  trace          = NULL;
+  delta          = NULL;
   p_sdb          = db;
   v_databuffer.reserve(buffers);
   for(int i=0;i<buffers;i++) {
@@ -205,10 +259,129 @@ SharedData::SharedData(int buffers, int files, int64 blksz, StagingDB* db, int b
     v_databuffer.push_back(*d);
   }
   filelocks = new Mutex[files];
+  sketches  = new BottomK[files];
+  filestats = new FileStats[files]();
+  extents   = new ExtentMap[files];
+  csizes    = new std::atomic<int64>[blocksize+1]();
+  zero      = 0;
 }
 
+// the CLI sets g_abort on ctrl-c (armTrap), it stops all scans
+bool SharedData::aborted() { return stop || g_abort; }
+
 SharedData::~SharedData() {
   delete[] filelocks;
+  delete[] sketches;
+  delete[] filestats;
+  delete[] extents;
+  delete[] csizes;
+}
+
+/*******************************************************************************
+ * Extent statistics - aggregates the results of a buffer per file extent
+ * Only called from the updater so no locking is required. Blocks are
+ * processed in scan order, a hash sample (1/16 of the non-zero hashes, picked
+ * by hash value so all copies of a block are in or out) is checked against the
+ * bloom filter to count blocks that were already seen earlier in the scan.
+ ******************************************************************************/
+
+void updateExtents(SharedData& sd, DataBuffer& buf) {
+  ExtentMap& r_map = sd.extents[buf.file];
+  ExtentStats* p_ext = NULL;
+  int64 extent = -1;
+  for(int j=0; j<buf.used; j++) {
+    int64 e = (buf.offset + j*buf.blockbytes) / sd.extentbytes;
+    if(e != extent) {
+      extent = e;
+      p_ext = &r_map[extent]; // new entries are zero-initialized
+    }
+    uint64 hash = buf.v_hash[j];
+    p_ext->blocks++;
+    if(hash==0) { p_ext->zero++; continue; }
+    if(buf.v_bytes[j] != -1) { p_ext->sampled++; p_ext->cbytes += buf.v_bytes[j]; }
+    if((hash >> 56) & 0xF) continue; // not in hash sample
+    p_ext->hashed++;
+    if(sd.seen.testset(hash)) p_ext->seen++;
+  }
+}
+
+/*******************************************************************************
+ * Live estimates - running thin, dedupe and compression ratios from the
+ * streaming counters kept by the workers (zero count, HyperLogLog of the
+ * hashes and the histogram of sampled compressed sizes, rounded up to the
+ * array's buckets). Compression is estimated over all sampled blocks, not
+ * only the unique ones, so it can differ slightly from the final report.
+ * Also written to the metrics stream if metrics is set (epoch)
+ ******************************************************************************/
+
+void liveStats(SharedData& sd, LiveStats& s) {
+  const int blocksize = sd.blocksize;
+  s.blocks        = sd.blocks;
+  s.bytes         = sd.bytes;
+  s.zero          = sd.zero;
+  int64  used     = s.blocks - s.zero;
+  s.distinct      = std::min(sd.distinct.estimate(), (double)used);
+  int64  sampled  = 0, allocated = 0;
+  size_t b = 0;
+  for(int kib=1; kib <= blocksize; kib++) {
+    int64 n = sd.csizes[kib];
+    if(!n) continue;
+    while(b < sd.buckets.size() && sd.buckets[b] < kib) b++;
+    sampled   += n;
+    allocated += n * (b < sd.buckets.size() ? sd.buckets[b] : blocksize);
+  }
+  s.thin   = safeDiv_float(s.blocks, used);
+  s.dedupe = safeDiv_float(used, s.distinct);
+  s.compr  = safeDiv_float(sampled * blocksize, allocated);
+  s.eta    = -1; // see liveEta
+}
+
+const std::string liveRatios(SharedData& sd, int64 metrics) {
+  LiveStats s;
+  liveStats(sd, s);
+  if(metrics) {
+    c_metrics << metrics << " scan.blocks "   << s.blocks << "\n"
+              << metrics << " scan.bytes "    << s.bytes  << "\n"
+              << metrics << " scan.zero "     << s.zero   << "\n"
+              << metrics << " scan.distinct " << (int64)s.distinct << "\n"
+              << metrics << " scan.thin "     << s.thin   << "\n"
+              << metrics << " scan.dedupe "   << s.dedupe << "\n"
+              << metrics << " scan.compress " << s.compr  << "\n";
+  }
+  return ", thin " + toString(s.thin) + " dedupe " + toString(s.dedupe) + " compr " + toString(s.compr) + " (est)";
+}
+
+// percentage done and ETA, overall on the progress line, also per file in the metrics
+const std::string liveEta(SharedData& sd, int64 metrics) {
+  const int64 blockbytes = sd.blocksize * 1024;
+  int64 eta = sd.eta.update(sd.bytes, sd.totalbytes);
+  if(metrics) {
+    for(size_t i=0; i<sd.filebytes.size(); i++) {
+      int64 done = sd.filestats[i].blocks * blockbytes;
+      int64 feta = sd.fileeta[i].update(done, sd.filebytes[i]);
+      if(!sd.filebytes[i]) continue;
+      c_metrics << metrics << " scan.file." << i+1 << ".done " << 100.0*done/sd.filebytes[i] << "\n";
+      if(feta>=0) c_metrics << metrics << " scan.file." << i+1 << ".eta " << feta << "\n";
+    }
+    if(eta>=0) c_metrics << metrics << " scan.eta " << eta << "\n";
+  }
+  if(!sd.totalbytes) return "";
+  std::stringstream ss;
+  ss << ", " << std::min((int64)100, 100*sd.bytes/sd.totalbytes) << "% ETA ";
+  if(eta<0) ss << "-";
+  else ss << eta/3600 << ":" << std::setfill('0') << std::setw(2) << eta/60%60 << ":" << std::setw(2) << eta%60;
+  return ss.str();
+}
+
+// live estimates for the progress line, metrics are written at most once per second
+const std::string liveStatus(SharedData& sd) {
+  static int64 lastmetrics = 0;
+  int64 now = epoch();
+  int64 metrics = (c_metrics.is_open() && now != lastmetrics) ? now : 0;
+  if(metrics) lastmetrics = now;
+  const std::string status = liveEta(sd, metrics) + liveRatios(sd, metrics);
+  if(metrics) c_metrics << std::flush;
+  return status;
 }
 
 /*******************************************************************************
@@ -221,14 +394,32 @@ void updater(int thread, SharedData& sd, Parameters& parameters) {
   size_t i=0;
   sd.p_sdb->begin();
   while(true) {
-    if(g_abort) break;
+    if(sd.aborted()) break;
     int rc = sd.rb.getused(i);
     if(rc) break;
-    //if(g_abort) break;
+    DataBuffer& r_buf = sd.v_databuffer[i];
+    BottomK& r_sketch = sd.sketches[r_buf.file];
+    FileStats& r_stats = sd.filestats[r_buf.file];
+    const uint64 salt  = (r_buf.file + 1) * 0x9E3779B97F4A7C15ULL;
+    for(int j=0; j<r_buf.used; j++) {
+      r_sketch.add(r_buf.v_hash[j]);
+      if(r_buf.v_hash[j] && sd.fileseen.testset(r_buf.v_hash[j] ^ salt)) r_stats.dupes++;
+    }
+    updateExtents(sd, r_buf);
+    if(sd.trace)
+      sd.trace->buffer(r_buf.file, r_buf.offset / r_buf.blockbytes, r_buf.used, &r_buf.v_hash[0], &r_buf.v_bytes[0]);
+    if(sd.delta && !r_buf.precomputed)
+      for(int j=0; j<r_buf.used; j++)
+        sd.delta->add(r_buf.file, r_buf.v_hash[j], &r_buf.v_sf[j*kdelta_sfs], r_buf[j], r_buf.v_lz4[j]);
+    if(r_buf.chunk) { // done with zero-copy data
+      r_buf.chunk->release();
+      r_buf.chunk = NULL;
+      r_buf.data  = r_buf.readbuf;
+    }
     if(!parameters.dryrun)
-      for(int j=0; j<sd.v_databuffer[i].used; j++)
-        sd.p_sdb->insertdata(sd.v_databuffer[i].v_hash[j],sd.v_databuffer[i].v_bytes[j]);
-        sd.v_databuffer[i].reset();
+      for(int j=0; j<r_buf.used; j++)
+        sd.p_sdb->insertdata(r_buf.v_hash[j],r_buf.v_bytes[j],sd.tags[r_buf.file]);
+    r_buf.reset();
     sd.rb.release(i);
   }
   sd.p_sdb->end();
@@ -236,9 +427,13 @@ void updater(int thread, SharedData& sd, Parameters& parameters) {
 
 /*******************************************************************************
  * Readstream - reads from stream (block/file/pipe) and fills buffers
+ * With a filesystem map (--fsaware), buffers that are completely unallocated
+ * are not read but handed to the workers as precomputed zero blocks, blocks
+ * that are unallocated in partially allocated buffers are zeroed after reading
+ * If the file has ranges (--trickle), only those are read
  ******************************************************************************/
 
-size_t readstream(int thread, SharedData& shared, FileData& fd) {
+size_t readstream(int thread, SharedData& shared, FileData& fd, int file) {
   int rc;
   int64 blocks;
   size_t bytes;
@@ -251,12 +446,55 @@ size_t readstream(int thread, SharedData& shared, FileData& fd) {
   char* zerobuf = new char[blocksize*1024];
   memset(zerobuf, 0, blocksize*1024);
   srand(thread);
+
+  size_t range = 0;     // current range
+  int64  pos   = 0;     // file offset of the next read
+  int64  end   = 0;     // end of the current range, 0 = read to end of file
+  if(!fd.ranges.empty()) {
+    pos = fd.ranges[0].first;
+    end = pos + fd.ranges[0].second;
+    fd.ifs->seekg(pos);
+  }
   
   while(!fd.ifs->eof()) {
-    if(g_abort) break;
+    if(shared.aborted()) break;
+    if(end && pos >= end) { // next range
+      if(++range >= fd.ranges.size()) break;
+      pos = fd.ranges[range].first;
+      end = pos + fd.ranges[range].second;
+      fd.ifs->seekg(pos);
+    }
+    int64 offset = pos;
+    int64 unalloc = 0; // unallocated blocks in this buffer
+    size_t want = end ? std::min((int64)iosize, end - pos) : iosize;
+
+    if(fd.fsmap && fd.size) {
+      int64 n = std::min((int64)want, fd.size - offset);
+      if(n <= 0) break;
+      if(fd.fsmap->isfree(offset, n)) { // skip, nothing to read
+        blocks    = (n + blocksize*1024 - 1) / (blocksize*1024);
+        totbytes += n;
+        pos      += n;
+        fd.ifs->seekg(pos);
+        for(int j=0;j<(fd.repeat?fd.repeat:1);j++) {
+          rc = shared.rb.getfree(i);
+          if(rc) break;
+          DataBuffer& r_buf = shared.v_databuffer[i];
+          std::fill(r_buf.v_hash.begin(),  r_buf.v_hash.begin()  + blocks, 0);
+          std::fill(r_buf.v_bytes.begin(), r_buf.v_bytes.begin() + blocks, 0);
+          r_buf.used        = blocks;
+          r_buf.file        = file;
+          r_buf.offset      = offset;
+          r_buf.precomputed = true;
+          shared.filestats[file].unalloc += blocks;
+          shared.rb.release(i);
+        }
+        if(pos >= fd.size) break;
+        continue;
+      }
+    }
     shared.throttle.request(shared.blockspercycle * blocksize); // IO throttling, sleep if we are going too fast
-    
-    fd.ifs->read(readbuf, iosize);
+    fd.ifs->read(readbuf, want);
     if(fd.ratio)
       for(int i=0; i<iosize/(blocksize*1024);i++) 
         memcpy(readbuf + (i* blocksize * 1024), zerobuf, abs(rand())%(blocksize*1024));
@@ -265,15 +503,27 @@ size_t readstream(int thread, SharedData& shared, FileData& fd) {
     blocks    = bytes / (blocksize*1024);         // amount of full blocks
     blocks   += bytes % (blocksize*1024) ? 1 : 0; // partial block read, add 1
     totbytes += bytes;
+    pos      += bytes;
 
     if(bytes<iosize)  // if we reached eof, clear rest of the buffer
       memset(readbuf + bytes, 0, iosize - bytes);
 
+    if(fd.fsmap) // unallocated blocks may hold stale data, they are free space
+      for(int b=0; b<blocks; b++)
+        if(fd.fsmap->isfree(offset + b*blocksize*1024, blocksize*1024)) {
+          memset(readbuf + b*blocksize*1024, 0, blocksize*1024);
+          unalloc++;
+        }
+
     for(int j=0;j<(fd.repeat?fd.repeat:1);j++) { // repeat processing the same buffer to simulate duplicates, usually repeat == 1
       rc = shared.rb.getfree(i);
       if(rc) break;
+      shared.filestats[file].unalloc += unalloc;
       memcpy(shared.v_databuffer[i].readbuf,readbuf,iosize);
       shared.v_databuffer[i].used = blocks;
+      shared.v_databuffer[i].file = file;
+      shared.v_databuffer[i].offset = offset;
+      shared.v_databuffer[i].precomputed = false;
       shared.rb.release(i);
     }
     if(fd.limit_mb && totbytes >= fd.limit_mb*1048576) break; // end if we only read a partial file
@@ -284,6 +534,49 @@ size_t readstream(int thread, SharedData& shared, FileData& fd) {
   return totbytes;
 }
 
+/*******************************************************************************
+ * Readsource - gets chunks from a zero-copy source (library) and hands them to
+ * the workers without copying. Whole blocks are processed in place, a partial
+ * block at the end of a chunk is copied to a buffer and padded with zeroes
+ ******************************************************************************/
+
+size_t readsource(int thread, SharedData& shared, FileData& fd, int file) {
+  const size_t blockbytes = shared.blocksize * 1024;
+  const size_t iosize     = shared.blockspercycle * blockbytes;
+  size_t totbytes = 0;
+  size_t bytes, i;
+  const char* data;
+
+  while(!shared.aborted() && (bytes = fd.source->next(data)) > 0) {
+    SourceChunk* chunk = new SourceChunk;
+    chunk->source = fd.source;
+    chunk->data   = data;
+    chunk->parts  = 1; // held by us until all parts are handed out
+    for(size_t pos = 0; pos < bytes; pos += iosize) {
+      size_t n = std::min(iosize, bytes - pos);
+      shared.throttle.request(n / 1024);
+      if(shared.rb.getfree(i)) break;
+      DataBuffer& r_buf = shared.v_databuffer[i];
+      r_buf.used = (n + blockbytes - 1) / blockbytes;
+      if(n % blockbytes) { // partial block at the end, copy
+        memcpy(r_buf.readbuf, data + pos, n);
+        memset(r_buf.readbuf + n, 0, r_buf.used * blockbytes - n);
+      } else {
+        chunk->parts++;
+        r_buf.data  = data + pos;
+        r_buf.chunk = chunk;
+      }
+      r_buf.file        = file;
+      r_buf.offset      = totbytes + pos;
+      r_buf.precomputed = false;
+      shared.rb.release(i);
+    }
+    chunk->release();
+    totbytes += bytes;
+  }
+  return totbytes;
+}
+
 /*******************************************************************************
  * Reader thread - finds one available file and starts readstream
  ******************************************************************************/
@@ -292,17 +585,57 @@ void reader(int thread, SharedData& sd, v_FileData& filelist) {
   armTrap();
   string self = "qdda-reader-" + toString(thread,0);
   pthread_setname_np(pthread_self(), self.c_str());
-  for(int i=0; i<filelist.size(); i++) {
+  for(int n=0; n<filelist.size(); n++) {
+    int i = sd.order[n];
     if(sd.filelocks[i].trylock()) continue; // in use
-    if(filelist[i].ifs->is_open()) {
-      size_t bytes = readstream(thread, sd, filelist[i]);
-      Lockguard lock(sd.mx_database);
-      sd.p_sdb->insertmeta(filelist[i].filename, bytes/sd.blocksize/1024, bytes);
-    }
+    if(filelist[i].source)
+      filelist[i].bytes = readsource(thread, sd, filelist[i], i);
+    else if(filelist[i].ifs && filelist[i].ifs->is_open())
+      filelist[i].bytes = readstream(thread, sd, filelist[i], i);
     sd.filelocks[i].unlock();
   }
 }
 
+/*******************************************************************************
+ * Replayer thread - feeds the results from a hash trace file into the buffers
+ * instead of data. There is no I/O (and no throttling), workers only do the
+ * accounting for precomputed buffers
+ ******************************************************************************/
+
+void replayer(SharedData& sd, TraceReader& trace, v_FileData& filelist) {
+  armTrap();
+  pthread_setname_np(pthread_self(), "qdda-replay");
+  size_t i;
+  try {
+    int type;
+    while((type = trace.next()) != ktrace_eof) {
+      if(sd.aborted()) break;
+      if(type == ktrace_file) {
+        filelist[trace.file].bytes  = trace.bytes;
+        filelist[trace.file].repeat = trace.repeat;
+        continue;
+      }
+      // a record can hold more blocks than a buffer (trace written with larger buffers)
+      for(size_t pos = 0; pos < trace.hashes.size(); ) {
+        if(sd.rb.getfree(i)) return;
+        DataBuffer& r_buf = sd.v_databuffer[i];
+        r_buf.used   = std::min(trace.hashes.size() - pos, r_buf.blocks);
+        r_buf.file   = trace.file;
+        r_buf.offset = (trace.block + pos) * r_buf.blockbytes;
+        r_buf.precomputed = true;
+        std::copy(trace.hashes.begin() + pos, trace.hashes.begin() + pos + r_buf.used, r_buf.v_hash.begin());
+        std::copy(trace.sizes.begin()  + pos, trace.sizes.begin()  + pos + r_buf.used, r_buf.v_bytes.begin());
+        pos += r_buf.used;
+        sd.rb.release(i);
+      }
+    }
+  }
+  catch (Fatal& e) {
+    e.print();
+    sd.stop = true;
+  }
+}
+
 /*******************************************************************************
  * Worker thread - picks filled buffers and runs hash/compression algorithms
  ******************************************************************************/
@@ -312,32 +645,34 @@ void worker(int thread, SharedData& sd, Parameters& parameters) {
   string self = "qdda-worker-" + toString(thread,0);
   pthread_setname_np(pthread_self(), self.c_str());
   const int64 blocksize = sd.blocksize;
-  char* dummy           = new char[blocksize*1024];
   size_t i              = 0;
   uint64_t hash;
   int bytes;
-
-  // define function pointer to the right compress function
-  u_int (*compress)(const char*,char*,const int);
-  switch(sd.method) {
-    case Metadata::lz4     : compress = compress_lz4;     break;
-    case Metadata::deflate : compress = compress_deflate; break;
-    default: compress = compress_none;
-  }
+  BlockKernel kernel(sd.method, blocksize*1024); // fused zero check, hash and compression
 
   while (true) {
-    if(g_abort) break;
+    if(sd.aborted()) break;
     int rc = sd.rb.getfull(i);
     if(rc) break;
+    int64 zero = 0, sampled = 0, cbytes = 0; // per buffer, added to the file stats in one go
     for(int j=0; j < sd.v_databuffer[i].used; j++) {
-      if(g_abort) return;
+      if(sd.aborted()) return;
       DataBuffer& r_blockdata = sd.v_databuffer[i]; // shorthand to buffer for readabily
-      hash = hash_md5(r_blockdata[j], dummy, blocksize*1024); // get hash
-      
-      if(rand()%sd.interval==0)
-        bytes = hash ? compress(r_blockdata[j], dummy, blocksize*1024) : 0; // get bytes, 0 if hash=0
-      else bytes=-1; // special case: -1 means this block was not analyzed for compression
+      if(r_blockdata.precomputed) { // replay
+        hash  = r_blockdata.v_hash[j];
+        bytes = r_blockdata.v_bytes[j];
+      } else {
+        // hash and compressed bytes (0 for zero blocks), bytes -1 means this block was not sampled for compression
+        hash = kernel.process(r_blockdata[j], rand()%sd.interval==0, bytes, sd.delta ? &r_blockdata.v_sf[j*kdelta_sfs] : NULL);
+
+        if(sd.delta) r_blockdata.v_lz4[j] = hash && deltaSample(hash) ? kernel.lz4size(r_blockdata[j]) : -1;
+      }
 
+      if(hash==0) zero++;
+      else {
+        sd.distinct.add(hash);
+        if(bytes>=0) { sampled++; cbytes += bytes; sd.csizes[(bytes+1023)/1024]++; }
+      }
       r_blockdata.v_hash[j] = hash;
       r_blockdata.v_bytes[j] = bytes;
       sd.v_databuffer[i].blockcount++;
@@ -349,74 +684,298 @@ void worker(int thread, SharedData& sd, Parameters& parameters) {
       }
       Lockguard lock(mx_print);
       if(sd.blocks%10000==0 || sd.blocks == 10) {
-        progress(sd.blocks, blocksize, sd.bytes);           // progress indicator
+        progress(sd.blocks, blocksize, sd.bytes, liveStatus(sd).c_str()); // progress indicator
       }
     }
+    FileStats& r_stats = sd.filestats[sd.v_databuffer[i].file];
+    r_stats.blocks  += sd.v_databuffer[i].used;
+    r_stats.zero    += zero;
+    r_stats.sampled += sampled;
+    r_stats.cbytes  += cbytes;
+    sd.zero         += zero;
     sd.rb.release(i);
   }
-  delete[] dummy;
 }
 
 /*******************************************************************************
- * Analyze function - Setup staging DB, worker and reader threads
- * to start data analyzer
+ * ScanEngine class - Setup staging DB, worker and reader threads
+ * to start data analyzer, see libqdda.h
  ******************************************************************************/
 
-void analyze(v_FileData& filelist, QddaDB& db, Parameters& parameters) {
+ScanEngine::ScanEngine(QddaDB& d, Parameters& p): db(d), parameters(p) {
+  started = false;
+}
+
+// stop threads if the engine is destroyed before finish() (i.e. exception)
+ScanEngine::~ScanEngine() {
+  if(!started) return;
+  sd->stop = true;
+  for(size_t i=0; i<readthreads.size(); i++) readthreads[i].join();
+  for(size_t i=0; i<workthreads.size(); i++) workthreads[i].join();
+  updatethread.join();
+}
+
+int ScanEngine::addfile(const FileData& file) {
+  if(started) throw ERROR("Cannot add files after the scan has started");
+  filelist.push_back(file);
+  return filelist.size()-1;
+}
+
+int ScanEngine::addstream(const string& name, const string& tag, int64 size) {
+  FileData fd;
+  fd.filename = name;
+  fd.tag      = tag;
+  fd.size     = size;
+  return addfile(fd);
+}
+
+int ScanEngine::addsource(const string& name, BlockSource* source, const string& tag, int64 size) {
+  int i = addstream(name, tag, size);
+  filelist[i].source = source;
+  return i;
+}
+
+void ScanEngine::start() {
   if(g_debug) cout << "Main thread pid " << getpid() << endl;
 
+  // replay: the file list comes from the trace file
+  if(!parameters.replay.empty()) {
+    if(!filelist.empty()) throw ERROR("Cannot combine --replay with files to scan");
+    replay.reset(new TraceReader(parameters.replay));
+    if(replay->blocksize != db.getblocksize() || replay->method != db.getmethod() || replay->interval != db.getinterval())
+      throw ERROR("Trace file blocksize/compression (") << replay->blocksize << "K, "
+            << Metadata::getMethodName(replay->method) << ":" << replay->interval
+            << ") does not match the database, use --array or --compress";
+    for(size_t i=0; i<replay->files.size(); i++) addstream(replay->files[i]);
+  }
+
   Database::deletedb(parameters.stagingname);
   StagingDB::createdb(parameters.stagingname, db.getblocksize());
-  StagingDB stagingdb(parameters.stagingname);
+  stagingdb.reset(new StagingDB(parameters.stagingname));
+
+  int files = 0; // files and sources for the reader threads
+  for(int i=0; i<filelist.size(); i++) if(filelist[i].ifs || filelist[i].source) files++;
+
+  int nworkers    = parameters.workers;
+  int readers     = replay ? 0 : std::min(files, parameters.readers);
+  int buffers     = parameters.buffers ? parameters.buffers : nworkers + readers + kextra_buffers;
+
+  sd.reset(new SharedData(buffers, filelist.size(), db.getblocksize(), stagingdb.get(), parameters.bandwidth));
+  sd->interval    = db.getinterval();
+  sd->method      = db.getmethod();
+  sd->extentbytes = (int64)parameters.extent * 1048576;
+  db.getbuckets(sd->buckets);
+
+  // tag ids are assigned in the main database so staging bitmasks can be merged as-is
+  for(int i=0; i<filelist.size(); i++) {
+    const std::string& tag = filelist[i].tag.empty() ? parameters.tag : filelist[i].tag;
+    tagids.push_back(tag.empty() ? 0 : db.gettag(tag));
+    sd->tags.push_back(tagids[i] ? (int64)1 << (tagids[i]-1) : 0);
+  }
+
+  // filesystem maps, unallocated blocks are not read
+  for(int i=0; i<filelist.size() && parameters.fsaware; i++) {
+    if(!filelist[i].ifs || filelist[i].size <= 0) continue;
+    std::string msg;
+    FsMap* map = FsMap::load(filelist[i].filename, msg);
+    if(!map) {
+      if(!g_quiet) cout << filelist[i].filename << ": " << msg << ", scanning all blocks" << endl;
+      continue;
+    }
+    fsmaps.push_back(std::unique_ptr<FsMap>(map));
+    filelist[i].fsmap     = map;
+    filelist[i].allocated = std::max(filelist[i].size - map->freebytes(), (int64)0);
+    if(!g_quiet) cout << filelist[i].filename << ": " << map->type() << ", "
+                      << toString(100.0 * (map->size() - map->freebytes()) / map->size(), 0)
+                      << "% allocated, skipping " << map->freebytes() / 1048576 << " MiB unallocated" << endl;
+  }
 
-  int workers     = parameters.workers;
-  int readers     = std::min( (int)filelist.size(), parameters.readers);
-  int buffers     = parameters.buffers ? parameters.buffers : workers + readers + kextra_buffers;
+  // expected bytes (including repeats) for progress/ETA
+  sd->totalbytes = 0;
+  sd->fileeta.resize(filelist.size());
+  bool unknown = false;
+  for(int i=0; i<filelist.size(); i++) {
+    int64 size = filelist[i].ranges.empty() ? std::max(filelist[i].size, (int64)0) : 0; // trickle: only the ranges
+    for(size_t r=0; r<filelist[i].ranges.size(); r++) size += filelist[i].ranges[r].second;
+    sd->filebytes.push_back(size * std::max(filelist[i].repeat, 1));
+    sd->totalbytes += sd->filebytes[i];
+    if(filelist[i].size < 0) unknown = true;
+    sd->order.push_back(i);
+  }
+  if(unknown) sd->totalbytes = 0;
+
+  // largest (allocated) files first so a big file isn't started last and delays
+  // the end of the scan. Unknown sizes (pipes) go first, they may be large
+  std::stable_sort(sd->order.begin(), sd->order.end(), [&](int a, int b) {
+    int64 wa = filelist[a].allocated >= 0 ? filelist[a].allocated * std::max(filelist[a].repeat, 1) : INT64_MAX;
+    int64 wb = filelist[b].allocated >= 0 ? filelist[b].allocated * std::max(filelist[b].repeat, 1) : INT64_MAX;
+    return wa > wb;
+  });
+
+  if(parameters.delta) {
+    if(replay) throw ERROR("Cannot combine --delta with --replay (the trace has no block contents)");
+    delta.reset(new DeltaIndex(filelist.size(), sd->blocksize * 1024));
+    sd->delta = delta.get();
+  }
 
-  SharedData sd(buffers, filelist.size(), db.getblocksize(), &stagingdb, parameters.bandwidth);
-  sd.interval = db.getinterval();
-  sd.method   = db.getmethod();
+  if(!parameters.tracefile.empty()) {
+    std::vector<std::string> names;
+    for(int i=0; i<filelist.size(); i++) names.push_back(filelist[i].filename);
+    trace.reset(new TraceWriter(parameters.tracefile, sd->blocksize, sd->method, sd->interval, names));
+    sd->trace = trace.get();
+  }
 
-  if(!g_quiet) cout
+  // pushed streams (not read by readers or replayed)
+  pushbuf.resize(filelist.size());
+  pushed.assign(filelist.size(), 0);
+  ended.assign(filelist.size(), 0);
+  for(int i=0; i<filelist.size(); i++)
+    if(replay || filelist[i].ifs || filelist[i].source) ended[i] = 1;
+    else pushbuf[i].resize(sd->blockspercycle * sd->blocksize * 1024);
+
+  if(!g_quiet && replay) cout
+    << "Replaying " << parameters.replay << ", "
+    << filelist.size() << " files, "
+    << nworkers << " workers, "
+    << buffers << " buffers" << endl;
+  else if(!g_quiet) cout
     << "Scanning " << filelist.size() << " files, " 
     << readers << " readers, " 
-    << workers << " workers, "
+    << nworkers << " workers, "
     << buffers << " buffers, "
     << parameters.bandwidth << " MB/s max" << endl;
 
-  std::thread updater_thread;
-  std::thread reader_thread[readers];
-  std::thread worker_thread[workers];
-  Stopwatch stopwatch;
+  started = true;
+  stopwatch.reset();
+  updatethread = std::thread(updater, 0, std::ref(*sd), std::ref(parameters));
+  for(int i=0; i<nworkers; i++) workthreads.push_back(std::thread(worker, i, std::ref(*sd), std::ref(parameters)));
+  for(int i=0; i<readers; i++) readthreads.push_back(std::thread(reader, i, std::ref(*sd), std::ref(filelist)));
+  if(replay) readthreads.push_back(std::thread(replayer, std::ref(*sd), std::ref(*replay), std::ref(filelist)));
+}
+
+// copy data (max one buffer) to a free buffer for the workers
+void ScanEngine::submit(int stream, const char* data, size_t bytes, int64 offset) {
+  size_t i;
+  if(sd->rb.getfree(i)) throw ERROR("Scan aborted");
+  DataBuffer& r_buf = sd->v_databuffer[i];
+  memcpy(r_buf.readbuf, data, bytes);
+  r_buf.used = (bytes + r_buf.blockbytes - 1) / r_buf.blockbytes;
+  memset(r_buf.readbuf + bytes, 0, r_buf.used * r_buf.blockbytes - bytes); // pad partial block
+  r_buf.file        = stream;
+  r_buf.offset      = offset;
+  r_buf.precomputed = false;
+  sd->rb.release(i);
+}
+
+// full buffers are copied directly from data, the rest is kept until the next push
+void ScanEngine::push(int stream, const char* data, size_t bytes) {
+  if(!started || stream < 0 || stream >= filelist.size() || ended[stream]) throw ERROR("Invalid stream ") << stream;
+  std::vector<char>& r_pbuf = pushbuf[stream];
+  const size_t iosize = r_pbuf.size();
+  while(bytes) {
+    size_t fill = pushed[stream] % iosize;
+    size_t n    = std::min(bytes, iosize - fill);
+    if(!fill && n == iosize) {
+      sd->throttle.request(iosize / 1024);
+      submit(stream, data, n, pushed[stream]);
+    } else {
+      memcpy(&r_pbuf[fill], data, n);
+      if(fill + n == iosize) {
+        sd->throttle.request(iosize / 1024);
+        submit(stream, &r_pbuf[0], iosize, pushed[stream] + n - iosize);
+      }
+    }
+    pushed[stream] += n;
+    data           += n;
+    bytes          -= n;
+  }
+}
 
-  updater_thread = std::thread(updater,0, std::ref(sd), std::ref(parameters));
-  for(int i=0; i<workers; i++) worker_thread[i] = std::thread(worker, i, std::ref(sd), std::ref(parameters));
-  for(int i=0; i<readers; i++) reader_thread[i] = std::thread(reader, i, std::ref(sd), std::ref(filelist));
+void ScanEngine::endstream(int stream) {
+  if(!started || stream < 0 || stream >= filelist.size() || ended[stream]) throw ERROR("Invalid stream ") << stream;
+  size_t fill = pushed[stream] % pushbuf[stream].size();
+  if(fill) submit(stream, &pushbuf[stream][0], fill, pushed[stream] - fill);
+  filelist[stream].bytes = pushed[stream];
+  ended[stream] = 1;
+  std::vector<char>().swap(pushbuf[stream]); // free memory
+}
 
-  signal(SIGINT, SIG_IGN); // ignore ctrl-c
+void ScanEngine::stats(LiveStats& s) {
+  if(!sd) throw ERROR("Scan not started");
+  Lockguard lock(mx_print); // workers update the progress line and ETA under this lock
+  liveStats(*sd, s);
+  s.eta = sd->eta.update(s.bytes, sd->totalbytes);
+}
 
-  for(int i=0; i<readers; i++) reader_thread[i].join(); 
-  sd.rb.done = true; // signal workers that reading is complete
-  for(int i=0; i<workers; i++) worker_thread[i].join();
-  updater_thread.join();
+void ScanEngine::finish() {
+  if(!started) throw ERROR("Scan not started");
+  for(int i=0; i<filelist.size(); i++) if(!ended[i] && !sd->aborted()) endstream(i);
+  for(size_t i=0; i<readthreads.size(); i++) readthreads[i].join(); 
+  sd->rb.done = true; // signal workers that reading is complete
+  for(size_t i=0; i<workthreads.size(); i++) workthreads[i].join();
+  updatethread.join();
+  readthreads.clear();
+  workthreads.clear();
+  started = false;
 
   stopwatch.lap();
   std::stringstream ss;
   ss << " Scanned in " << stopwatch.seconds() << " seconds";
-  progress(sd.blocks, sd.blocksize, sd.bytes, ss.str().c_str());
+  progress(sd->blocks, sd->blocksize, sd->bytes, ss.str().c_str());
   if(!g_quiet) cout << endl;
   int64 sumblocks = 0;
   int64 sumbytes = 0;
-  for(int i=0;i<sd.rb.getsize();i++) {
-    sumblocks += sd.v_databuffer[i].blockcount;
-    sumbytes  += sd.v_databuffer[i].bytes;
+  for(int i=0;i<sd->rb.getsize();i++) {
+    sumblocks += sd->v_databuffer[i].blockcount;
+    sumbytes  += sd->v_databuffer[i].bytes;
   }
   if(g_debug) cerr << "Blocks processed " << sumblocks 
             << ", bytes = " << sumbytes
             << " (" << std::fixed << std::setprecision(2) << sumbytes/1024.0/1024 << " MiB)" << endl;
-  if(g_abort) {
-    stagingdb.close();
-    Database::deletedb(parameters.stagingname); // delete invalid database if we were interrupted
+  // file metadata is saved after the updater is done so the sketches are complete
+  if(!sd->aborted()) {
+    stagingdb->begin();
+    for(int i=0; i<filelist.size(); i++) {
+      FileStats& r_stats = sd->filestats[i];
+      int64 repeat = std::max(filelist[i].repeat, 1);   // counters are per pass over the file
+      int64 dupes  = r_stats.dupes - (repeat-1) * ((r_stats.blocks - r_stats.zero)/repeat); // intra-file duplicates (one pass), later passes are all seen
+      sql_int id   = stagingdb->insertmeta(filelist[i].filename, filelist[i].bytes/sd->blocksize/1024, filelist[i].bytes, sd->sketches[i].serialize(), tagids[i]);
+      stagingdb->setfilestats(id, r_stats.zero/repeat, r_stats.sampled/repeat, r_stats.cbytes/repeat, std::max(dupes, (int64)0), r_stats.unalloc/repeat);
+      if(delta) {
+        const DeltaStats& r_delta = delta->getstats(i);
+        stagingdb->setdeltastats(id, r_delta.similar, r_delta.sampled, r_delta.dbytes, r_delta.cbytes);
+      }
+      for(auto it = sd->extents[i].begin(); it != sd->extents[i].end(); ++it) {
+        ExtentStats ext = it->second; // one pass, the hashes of later passes are all seen
+        ext.blocks  /= repeat;
+        ext.zero    /= repeat;
+        ext.sampled /= repeat;
+        ext.cbytes  /= repeat;
+        ext.hashed  /= repeat;
+        ext.seen     = std::max(ext.seen - (repeat-1) * ext.hashed, (sql_int)0);
+        stagingdb->insertextent(id, it->first * parameters.extent, parameters.extent, ext);
+      }
+    }
+    stagingdb->end();
+    if(trace) {
+      for(int i=0; i<filelist.size(); i++) trace->fileend(i, filelist[i].bytes, filelist[i].repeat);
+      trace->finish();
+    }
   }
+  stagingdb->close();
+  if(sd->aborted()) Database::deletedb(parameters.stagingname); // delete invalid database if we were interrupted
+  if(sd->stop) throw ERROR("Scan failed"); // not interrupted (the cause is already reported)
+}
+
+/*******************************************************************************
+ * Analyze function - scan a list of files (command line)
+ ******************************************************************************/
+
+void analyze(v_FileData& filelist, QddaDB& db, Parameters& parameters) {
+  ScanEngine engine(db, parameters);
+  for(int i=0; i<filelist.size(); i++) engine.addfile(filelist[i]);
+  engine.start();
+  signal(SIGINT, SIG_IGN); // ignore ctrl-c in this thread, readers and workers abort
+  engine.finish();
   resetTrap();
 }
@@ -9,13 +9,20 @@
 
 #pragma once
 
+class TraceWriter;
+class DeltaIndex;
+class BlockSource;
+struct LiveStats;
+
 typedef std::vector<uint64> v_uint64;
+typedef std::map<int64, ExtentStats> ExtentMap; // extent number -> stats
 
 /*******************************************************************************
  * Functions
  ******************************************************************************/
 
 long threadpid();
+void liveStats(SharedData& sd, LiveStats& s);
 
 /*******************************************************************************
  * Mutex class
@@ -38,6 +45,18 @@ private:
   pthread_mutexattr_t attr;
 };
 
+/*******************************************************************************
+ * SourceChunk - a chunk of a zero-copy source (BlockSource), may be spread over
+ * multiple buffers. The source is notified when the last one is processed
+ ******************************************************************************/
+
+struct SourceChunk {
+  BlockSource*     source;
+  const char*      data;
+  std::atomic<int> parts;  // buffers (and the reader) still using the chunk
+  void release();          // drop one part, calls source->done() after the last
+};
+
 /*******************************************************************************
  * Databuffer class - holds <blockspercycle> blocks of data from a stream
  * read by the reader to be processed by the worker
@@ -52,16 +71,36 @@ public:
   size_t blocks;           // size of buffer in blocks
   size_t bufsize;          // size of the read buffer in bytes
   int    used;             // number of used blocks in the buffer
+  int    file;             // index of the file the data was read from
+  int64  offset;           // offset in the file (bytes) of the first block
+  bool   precomputed;      // hashes and bytes already filled in (replay), workers skip them
   int64  blockcount;       // blocks read
   size_t bytes;            // bytes read
   char*  readbuf;          // the actual data
+  const char* data;        // data to process, readbuf or zero-copy source data
+  SourceChunk* chunk;      // zero-copy source chunk, NULL if data is in readbuf
   v_uint64 v_hash;         // array of hashes
   v_uint64 v_bytes;        // array of compressed byte sizes
+  v_uint64 v_sf;           // super-features (kdelta_sfs per block, --delta)
+  v_uint64 v_lz4;          // one-shot LZ4 size for delta samples (--delta), -1 if not needed
   uint64 blockbytes;       // blocksize in bytes
 private:
   DataBuffer() = delete;
 };
 
+/*******************************************************************************
+ * FileStats struct - per-file counters, updated lock-free by the workers
+ ******************************************************************************/
+
+struct FileStats {
+  std::atomic<int64> blocks;  // blocks processed (including repeats)
+  std::atomic<int64> zero;    // zero blocks
+  std::atomic<int64> sampled; // non-zero blocks sampled for compression
+  std::atomic<int64> cbytes;  // compressed bytes of sampled blocks
+  std::atomic<int64> unalloc; // unallocated blocks (--fsaware), not read, counted as zero
+  int64              dupes;   // non-zero blocks seen before in the same file (updater, all passes)
+};
+
 /*******************************************************************************
  * IOThrottle class - holds shared data to provide IO bandwidth throttling
  ******************************************************************************/
@@ -76,6 +115,24 @@ private:
   std::mutex mx_throttle;            // thread safe
 };
 
+/*******************************************************************************
+ * Eta class - estimated time to complete a number of bytes. The throughput is
+ * sampled at most once per second and smoothed (exponentially weighted) so
+ * the ETA doesn't jump around with short stalls or bursts
+ ******************************************************************************/
+
+class Eta {
+public:
+  Eta() { started = false; rate = 0; prevbytes = 0; prevtime = 0; }
+  int64 update(int64 done, int64 total); // seconds remaining, -1 if unknown
+private:
+  bool      started;   // first bytes seen, timing started
+  double    rate;      // smoothed bytes/sec
+  int64     prevbytes; // bytes at previous sample
+  int64     prevtime;  // usec at previous sample
+  Stopwatch stopwatch;
+};
+
 /*******************************************************************************
  * Ringbuffer class - Keeps track of multiple buffers between threads
  * 
@@ -99,7 +156,7 @@ private:
 
 class RingBuffer {
 public:
-  explicit RingBuffer(size_t sz);  // create ringbuffer with sz buffers
+  RingBuffer(size_t sz, const std::atomic<bool>& stop); // create ringbuffer with sz buffers
   int getfree(size_t& ix);         // get ref to a free buffer (for reader)
   int getfull(size_t& ix);         // get ref to a full buffer (for worker)
   int getused(size_t& ix);         // get ref to a used buffer (for updater)
@@ -112,6 +169,8 @@ private:
   bool hasData();               // Test if ringbuffer has unprocessed data
   bool isEmpty();               // Test if ringbuffer is empty
   bool isDone();                // Test if ringbuffer is done
+  bool aborted();               // scan stopped or interrupted
+  const std::atomic<bool>& stop;// SharedData::stop
   std::mutex mx_meta;           // mutex for updating RB metadata
   std::mutex tailbusy;          // mutex for updating tail
   std::mutex headbusy;          // mutex for updating head
@@ -130,6 +189,8 @@ private:
 struct SharedData {
   SharedData(int buffers, int files, int64 blocksize, StagingDB*, int mibps);
  ~SharedData();
+  bool                    aborted(); // stop is set or the program is interrupted (g_abort)
+  std::atomic<bool>       stop;      // stop this scan (engine destroyed or failed)
   std::vector<DataBuffer> v_databuffer;
   RingBuffer              rb;
   Blocksize               blocksize;
@@ -141,6 +202,24 @@ struct SharedData {
   IOThrottle              throttle;
   int64                   blockspercycle;
   Mutex*                  filelocks;
+  BottomK*                sketches;
+  FileStats*              filestats;
+  ExtentMap*              extents;
+  int64                   extentbytes;
+  BloomFilter             seen;
+  BloomFilter             fileseen;  // hashes salted with the file index: duplicates within a file
+  HyperLogLog             distinct;  // live estimates: distinct non-zero blocks
+  std::atomic<int64>*     csizes;    // live estimates: sampled blocks per compressed size (KiB)
+  std::atomic<int64>      zero;      // live estimates: zero blocks
+  IntArray                buckets;   // compression bucket sizes (KiB)
+  std::vector<int>        order;     // order in which readers pick files (largest first)
+  std::vector<int64>      filebytes; // bytes to process per file including repeats, 0 = unknown
+  int64                   totalbytes;// sum of filebytes, 0 if any is unknown
+  TraceWriter*            trace;     // write hash trace (updater), NULL if disabled
+  DeltaIndex*             delta;     // similar block index (updater), NULL if disabled
+  std::vector<int64>      tags;      // tag bitmask (kv.tags) per file
+  Eta                     eta;       // overall ETA
+  std::vector<Eta>        fileeta;   // ETA per file
   std::mutex              mx_shared;
   std::mutex              mx_database;
 };
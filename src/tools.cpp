@@ -11,20 +11,27 @@
 #include <iomanip>
 #include <fstream>
 #include <sstream>
+#include <algorithm>
 
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #include <sys/statvfs.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <pwd.h>
 #include <getopt.h>
 #include <signal.h>
+#include <errno.h>
 
 #include "error.h"
 #include "tools.h"
 
 using std::string;
 
-sig_atomic_t g_abort; // signal other threads we've aborted
+volatile sig_atomic_t g_abort; // signal other threads we've aborted
 extern bool g_debug;  // debug flag
 
 // show line and filename (using #define debug macro)
@@ -86,6 +93,28 @@ off_t fileSize(const char *filename) {
   return -1; 
 }
 
+// block devices report st_size 0, ask the device instead
+int64 deviceSize(const char *filename) {
+  struct stat st;
+  if(stat(filename, &st) != 0) return -1;
+  if(S_ISREG(st.st_mode)) return st.st_size;
+  if(!S_ISBLK(st.st_mode)) return -1;
+  uint64 bytes = 0;
+  int fd = open(filename, O_RDONLY);
+  if(fd < 0) return -1;
+  int rc = ioctl(fd, BLKGETSIZE64, &bytes);
+  close(fd);
+  return rc ? -1 : bytes;
+}
+
+// holes in sparse files don't cause I/O
+int64 allocatedSize(const char *filename) {
+  struct stat st;
+  if(stat(filename, &st) != 0) return -1;
+  if(S_ISREG(st.st_mode)) return std::min((int64)st.st_blocks * 512, (int64)st.st_size);
+  return deviceSize(filename);
+}
+
 // return dir part of filename
 const string dirName(const string& in) {
   string dir;
@@ -139,6 +168,18 @@ int cpuCount() {
   return sysconf(_SC_NPROCESSORS_ONLN);
 }
 
+// Lowest CPU priority (nice 19) and idle I/O class for this and new threads,
+// best effort - the idle class only works with I/O schedulers that support it
+void lowPriority() {
+  const int ioprio_who_process = 1;
+  const int ioprio_idle        = 3 << 13; // IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT
+  // not fatal, the scan just runs at normal priority
+  if(setpriority(PRIO_PROCESS, 0, 19) && g_debug)
+    std::cerr << "Cannot set nice 19: " << strerror(errno) << std::endl;
+  if(syscall(SYS_ioprio_set, ioprio_who_process, 0, ioprio_idle) && g_debug)
+    std::cerr << "Cannot set idle I/O priority: " << strerror(errno) << std::endl;
+}
+
 /*******************************************************************************
  * Stopwatch - a timer class that keeps track of time in microseconds
  ******************************************************************************/
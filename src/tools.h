@@ -15,6 +15,7 @@
 #include <sstream>
 #include <ostream>
 #include <string.h>
+#include <signal.h>
 
 #include "error.h"
 
@@ -81,6 +82,7 @@ inline uint64 longRand()                      { return ((uint64)rand() << 32) +
  ******************************************************************************/
 
 int   cpuCount();                                    // return number of cpus (cores)
+void  lowPriority();                                 // nice 19 and idle I/O priority (background scans)
 int64 epoch();                                       // secs since 1970
 const char* hostName();                              // system hostname
 const char* whoAmI();                                // path to self
@@ -89,6 +91,10 @@ const std::string  dirName(const std::string& file); // return dir portion of fi
 int   fileExists(const char * fn);                   // return true if file exists
 long  fileSystemFree(const char* filename);          // filesystem free in MB for this file
 off_t fileSize(const char *filename);                // return size of file in bytes
+int64 deviceSize(const char *filename);              // size of block device or file in bytes, -1 if unknown (pipe etc)
+int64 allocatedSize(const char *filename);           // allocated bytes of (sparse) file, same as deviceSize for devices
+
+extern volatile sig_atomic_t g_abort; // set by the SIGINT handler (armTrap)
 
 void armTrap();   // interrupt handler, enable
 void resetTrap(); // disable
@@ -0,0 +1,164 @@
+/*******************************************************************************
+ * Title       : trace.cpp
+ * Description : Hash trace files (record and replay scan results) for qdda
+ * Author      : Bart Sjerps <bart@dirty-cache.com>
+ * License     : GPLv3+
+ * Disclaimer  : See https://www.gnu.org/licenses/gpl-3.0.txt
+ * More info   : https://wiki.dirty-cache.com/qdda
+ ******************************************************************************/
+
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <cstring>
+
+#include "error.h"
+#include "tools.h"
+#include "trace.h"
+
+const char*  ktrace_magic   = "qddatrc1";
+const size_t ktrace_flushsz = 65536; // write to gz stream in chunks of this size
+
+/*******************************************************************************
+ * TraceWriter class functions
+ ******************************************************************************/
+
+TraceWriter::TraceWriter(const std::string& fn, int blocksize, int method, int interval, const std::vector<std::string>& files) {
+  error = false;
+  gz = gzopen(fn.c_str(), "wb1"); // fast compression, hashes don't compress anyway
+  if(!gz) throw ERROR("Cannot create trace file ") << fn;
+  buf = ktrace_magic;
+  put(blocksize);
+  put(method);
+  put(interval);
+  put(files.size());
+  for(size_t i=0; i<files.size(); i++) {
+    put(files[i].size());
+    buf += files[i];
+  }
+}
+
+TraceWriter::~TraceWriter() { if(gz) gzclose(gz); }
+
+void TraceWriter::put(uint64 v) {
+  while(v >= 0x80) { buf += (char)(v | 0x80); v >>= 7; }
+  buf += (char)v;
+}
+
+void TraceWriter::flush() {
+  if(buf.empty() || !gz) return;
+  if(gzwrite(gz, buf.data(), buf.size()) != (int)buf.size()) error = true;
+  buf.clear();
+}
+
+void TraceWriter::buffer(int file, int64 block, int count, const uint64* hashes, const uint64* bytes) {
+  put(ktrace_buffer);
+  put(file);
+  put(block);
+  put(count);
+  for(int i=0; i<count; i++) {
+    for(int b=0; b<8; b++) buf += (char)((hashes[i] >> (8*b)) & 0xFF);
+    put(bytes[i] + 1); // -1 (not sampled) becomes 0
+  }
+  if(buf.size() >= ktrace_flushsz) flush();
+}
+
+void TraceWriter::fileend(int file, int64 bytes, int repeat) {
+  put(ktrace_file);
+  put(file);
+  put(bytes);
+  put(repeat);
+}
+
+void TraceWriter::finish() {
+  put(ktrace_end);
+  flush();
+  if(gzclose(gz) != Z_OK) error = true;
+  gz = 0;
+  if(error) throw ERROR("Error writing trace file");
+}
+
+/*******************************************************************************
+ * TraceReader class functions
+ ******************************************************************************/
+
+TraceReader::TraceReader(const std::string& filename) {
+  fn  = filename;
+  pos = len = 0;
+  gz  = gzopen(fn.c_str(), "rb");
+  if(!gz) throw ERROR("Cannot open trace file ") << fn;
+  char magic[8];
+  for(int i=0; i<8; i++) magic[i] = getc();
+  if(memcmp(magic, ktrace_magic, 8)) throw ERROR("Not a qdda trace file: ") << fn;
+  blocksize = get();
+  method    = get();
+  interval  = get();
+  int n     = get();
+  for(int i=0; i<n; i++) {
+    int sz = get();
+    std::string name;
+    for(int j=0; j<sz; j++) name += (char)getc();
+    files.push_back(name);
+  }
+}
+
+TraceReader::~TraceReader() { gzclose(gz); }
+
+int TraceReader::getc() {
+  if(pos == len) {
+    len = gzread(gz, buf, sizeof(buf));
+    pos = 0;
+    if(len <= 0) { len = 0; return -1; }
+  }
+  return (unsigned char)buf[pos++];
+}
+
+uint64 TraceReader::get() {
+  uint64 v = 0;
+  for(int shift = 0; shift < 64; shift += 7) {
+    int c = getc();
+    if(c < 0) throw ERROR("Trace file incomplete: ") << fn;
+    v |= (uint64)(c & 0x7F) << shift;
+    if(!(c & 0x80)) return v;
+  }
+  throw ERROR("Trace file corrupt: ") << fn;
+}
+
+int TraceReader::next() {
+  int type = getc();
+  switch(type) {
+    case ktrace_buffer: {
+      file  = get();
+      block = get();
+      int count = get();
+      hashes.resize(count);
+      sizes.resize(count);
+      for(int i=0; i<count; i++) {
+        uint64 hash = 0;
+        for(int b=0; b<8; b++) {
+          int c = getc();
+          if(c < 0) throw ERROR("Trace file incomplete: ") << fn;
+          hash |= (uint64)c << (8*b);
+        }
+        hashes[i] = hash;
+        sizes[i]  = get() - 1;
+      }
+      break;
+    }
+    case ktrace_file:
+      file   = get();
+      bytes  = get();
+      repeat = get();
+      break;
+    case ktrace_end:
+      return ktrace_eof;
+    case -1:
+      throw ERROR("Trace file incomplete (scan interrupted?): ") << fn;
+    default:
+      throw ERROR("Trace file corrupt: ") << fn;
+  }
+  if(file < 0 || file >= (int)files.size()) throw ERROR("Trace file corrupt: ") << fn;
+  return type;
+}
@@ -0,0 +1,73 @@
+/*******************************************************************************
+ * Title       : trace.h
+ * Description : header file for trace.cpp - hash trace files
+ * Author      : Bart Sjerps <bart@dirty-cache.com>
+ * License     : GPLv3+, https://www.gnu.org/licenses/gpl-3.0.txt
+ * Disclaimer  : GPLv3+
+ * URL         : https://wiki.dirty-cache.com/qdda
+ ******************************************************************************/
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "zlib/zlib.h"
+#include "tools.h"
+
+/*******************************************************************************
+ * A hash trace file holds the results of a scan (hash and compressed bytes of
+ * each block) in the order the updater processed them, so the scan can be
+ * replayed into a new database without reading the data again.
+ *
+ * Format (gzip compressed, integers are LEB128 varints unless noted):
+ * header  : "qddatrc1" blocksize(KiB) method interval files {namelen name}
+ * records : 1 file block count {hash(8 bytes LE) bytes+1}  - one data buffer
+ *           2 file bytes repeat                            - file completed
+ *           3                                              - end of trace
+ * block is the offset of the first block in blocks, bytes+1 is 0 for blocks
+ * that were not sampled for compression (bytes = -1).
+ ******************************************************************************/
+
+enum TraceRecord { ktrace_eof = 0, ktrace_buffer = 1, ktrace_file = 2, ktrace_end = 3 };
+
+class TraceWriter {
+public:
+  TraceWriter(const std::string& fn, int blocksize, int method, int interval, const std::vector<std::string>& files);
+ ~TraceWriter();
+  void buffer(int file, int64 block, int count, const uint64* hashes, const uint64* bytes);
+  void fileend(int file, int64 bytes, int repeat);
+  void finish();                 // write end marker and close, throws on write errors
+private:
+  TraceWriter(const TraceWriter&) = delete;
+  void put(uint64 v);            // add varint to buffer
+  void flush();                  // write buffer to file
+  gzFile      gz;
+  std::string buf;
+  bool        error;             // write error (in updater thread, reported by finish)
+};
+
+class TraceReader {
+public:
+  explicit TraceReader(const std::string& fn);
+ ~TraceReader();
+  int next();                    // read next record, returns TraceRecord type
+  int   blocksize;               // header info
+  int   method;
+  int   interval;
+  std::vector<std::string> files;
+  int   file;                    // ktrace_buffer and ktrace_file record fields
+  int64 block;
+  int64 bytes;
+  int   repeat;
+  std::vector<uint64> hashes;
+  std::vector<uint64> sizes;     // compressed bytes (-1 = not sampled)
+private:
+  TraceReader(const TraceReader&) = delete;
+  int    getc();                 // next byte, -1 at end of file
+  uint64 get();                  // next varint, throws at end of file
+  gzFile      gz;
+  std::string fn;
+  char        buf[65536];
+  int         pos, len;
+};
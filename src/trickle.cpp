@@ -0,0 +1,201 @@
+/*******************************************************************************
+ * Title       : trickle.cpp
+ * Description : Continuous low-impact scanning with rolling estimates for qdda
+ * Author      : Bart Sjerps <bart@dirty-cache.com>
+ * License     : GPLv3+
+ * Disclaimer  : See https://www.gnu.org/licenses/gpl-3.0.txt
+ * More info   : https://wiki.dirty-cache.com/qdda
+ ******************************************************************************/
+
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "error.h"
+#include "tools.h"
+#include "trickle.h"
+
+using std::string;
+using std::cout;
+using std::endl;
+
+extern bool g_quiet;
+extern std::ofstream c_metrics;
+
+const double ktrickle_decay = 0.5;        // weight of the last completed pass in the history
+const int64  ktrickle_keep  = 30 * 86400; // keep estimates for 30 days
+
+/*******************************************************************************
+ * Helper functions
+ ******************************************************************************/
+
+static uint64 splitmix(uint64 x) {
+  x += 0x9E3779B97F4A7C15ULL;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+// position i (0..n-1) to extent number, a pseudo-random permutation of 0..n-1
+// for each seed. Cycle walking over a bijection of the enclosing power of 2
+// (add, multiply by odd number and xorshift are all invertible mod 2^bits)
+static int64 permute(int64 i, int64 n, uint64 seed) {
+  int bits = 1;
+  while(((int64)1 << bits) < n) bits++;
+  const uint64 mask  = ((uint64)1 << bits) - 1;
+  const int    shift = bits / 2 + 1;
+  uint64 x = i;
+  do {
+    x = (x + seed) & mask;
+    x = (x * (seed | 1)) & mask;
+    x ^= x >> shift;
+    x = (x * 0x9E3779B97F4A7C15ULL) & mask;
+    x ^= x >> shift;
+  } while(x >= (uint64)n);
+  return x;
+}
+
+// a + w * (b - a), ratios of 0 (no data) don't change the estimate
+static TrickleRatios blend(const TrickleRatios& a, const TrickleRatios& b, double w) {
+  TrickleRatios r;
+  r.thin   = b.thin   ? a.thin   + w * (b.thin   - a.thin)   : a.thin;
+  r.dedupe = b.dedupe ? a.dedupe + w * (b.dedupe - a.dedupe) : a.dedupe;
+  r.compr  = b.compr  ? a.compr  + w * (b.compr  - a.compr)  : a.compr;
+  return r;
+}
+
+/*******************************************************************************
+ * Trickle class functions
+ ******************************************************************************/
+
+Trickle::Trickle(QddaDB& d, const v_FileData& files, int64 xbytes, int64 roundbytes): db(d) {
+  extentbytes = xbytes;
+  if(roundbytes < extentbytes)
+    throw ERROR("Trickle round size (") << roundbytes/1048576 << " MiB) is smaller than the extent size ("
+      << extentbytes/1048576 << " MiB), use a larger round or a smaller --extent";
+  std::stringstream ss;
+  int64 total = 0;
+  for(size_t i=0; i<files.size(); i++) {
+    if(files[i].size < 0) throw ERROR("Cannot trickle scan ") << files[i].filename << " (size unknown)";
+    extents.push_back(divRoundUp(files[i].size, extentbytes));
+    total += extents[i];
+    ss << files[i].filename << ":" << files[i].size << "\n";
+  }
+  if(!total) throw ERROR("Nothing to trickle scan (all files are empty)");
+  rounds = divRoundUp(total, roundbytes / extentbytes);
+  ss << extentbytes << ":" << rounds;
+  signature = ss.str();
+
+  Query q(db, "select signature, pass, round, seed, h_thin, h_dedupe, h_compress from trickle");
+  if(q.next() && q.getstr(0) == signature) { // continue where we left off
+    pass    = q.getint(1);
+    round   = q.getint(2);
+    seed    = q.getint(3);
+    history = !q.isnull(4);
+    h.thin   = q.getfloat(4);
+    h.dedupe = q.getfloat(5);
+    h.compr  = q.getfloat(6);
+  }
+  else newpass(true);
+}
+
+void Trickle::newpass(bool restart) {
+  if(restart) { pass = 0; history = false; }
+  pass++;
+  round = 0;
+  seed  = splitmix(epoch() ^ (pass << 32));
+  save();
+}
+
+void Trickle::save() {
+  Query q_del(db, "delete from trickle");
+  Query q_ins(db, "insert into trickle (signature, pass, round, rounds, seed, h_thin, h_dedupe, h_compress) values (?,?,?,?,?,?,?,?)");
+  q_ins << signature << pass << round << rounds << (sql_int)seed;
+  if(history) { q_ins.bindf(h.thin); q_ins.bindf(h.dedupe); q_ins.bindf(h.compr); }
+  else        { q_ins.bind(); q_ins.bind(); q_ins.bind(); }
+  db.begin();
+  q_del.exec();
+  q_ins.exec();
+  db.end();
+}
+
+// files without extents in this round are removed from the list
+void Trickle::plan(v_FileData& files) {
+  if(round == 0) db.clear(); // new pass, kv only holds the current pass
+  v_FileData planned;
+  for(size_t i=0; i<files.size(); i++) {
+    FileData& r_file = files[i];
+    const int64 n = extents[i];
+    std::vector<int64> ext;
+    for(int64 p = round * n / rounds; p < (round+1) * n / rounds; p++)
+      ext.push_back(permute(p, n, splitmix(seed + i)));
+    std::sort(ext.begin(), ext.end()); // read in offset order
+    r_file.ranges.clear();
+    for(size_t e=0; e<ext.size(); e++) {
+      int64 offset = ext[e] * extentbytes;
+      r_file.ranges.push_back(std::make_pair(offset, std::min(extentbytes, r_file.size - offset)));
+    }
+    if(r_file.ranges.empty()) { delete r_file.ifs; continue; }
+    planned.push_back(r_file);
+  }
+  files.swap(planned);
+}
+
+void Trickle::done() {
+  round++;
+  const double coverage = (double)round / rounds;
+
+  // pass to date, same as the report
+  TrickleRatios cur;
+  int64 blocks_total = db.getint("select sum(blocks) from kv");
+  int64 blocks_used  = db.getint("select sum(ref*blocks) from m_sums_deduped");
+  int64 blocks_dedup = db.getint("select sum(blocks) from m_sums_deduped");
+  cur.thin   = safeDiv_float(blocks_total, blocks_used);
+  cur.dedupe = safeDiv_float(blocks_used, blocks_dedup);
+  cur.compr  = db.getfloat("select 1.0*(select sum(buckets) from v_compressed)/(select sum(blocks) from v_compressed)");
+
+  // weight grows to the decay at the end of the pass, same as the new history
+  TrickleRatios r = history ? blend(h, cur, ktrickle_decay * coverage) : cur;
+  if(round >= rounds) { // pass complete, decay the history
+    h = history ? blend(h, cur, ktrickle_decay) : cur;
+    history = true;
+    r = h;
+  }
+
+  int64 now = epoch();
+  Query q_est(db, "insert into estimates (timestamp, pass, round, coverage, thin, dedupe, compress, r_thin, r_dedupe, r_compress) "
+                  "values (?,?,?,?,?,?,?,?,?,?)");
+  q_est << now << pass << round;
+  q_est.bindf(100.0 * coverage);
+  q_est.bindf(cur.thin); q_est.bindf(cur.dedupe); q_est.bindf(cur.compr);
+  q_est.bindf(r.thin);   q_est.bindf(r.dedupe);   q_est.bindf(r.compr);
+  q_est.exec();
+  Query q_prune(db, "delete from estimates where timestamp < ?");
+  q_prune.bind(now - ktrickle_keep);
+  q_prune.exec();
+
+  if(c_metrics.is_open()) {
+    c_metrics << now << " trickle.pass "             << pass            << "\n"
+              << now << " trickle.coverage "         << 100.0*coverage  << "\n"
+              << now << " trickle.thin "             << cur.thin        << "\n"
+              << now << " trickle.dedupe "           << cur.dedupe      << "\n"
+              << now << " trickle.compress "         << cur.compr       << "\n"
+              << now << " trickle.combined "         << cur.combined()  << "\n"
+              << now << " trickle.rolling.thin "     << r.thin          << "\n"
+              << now << " trickle.rolling.dedupe "   << r.dedupe        << "\n"
+              << now << " trickle.rolling.compress " << r.compr         << "\n"
+              << now << " trickle.rolling.combined " << r.combined()    << "\n" << std::flush;
+  }
+  if(!g_quiet) cout
+    << "Trickle pass " << pass << " round " << round << "/" << rounds
+    << " (" << toString(100.0*coverage, 1) << "% covered): thin " << toString(cur.thin)
+    << " dedupe " << toString(cur.dedupe) << " compr " << toString(cur.compr)
+    << ", rolling " << toString(r.combined()) << endl;
+
+  if(round >= rounds) newpass(false);
+  else save();
+}
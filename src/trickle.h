@@ -0,0 +1,59 @@
+/*******************************************************************************
+ * Title       : trickle.h
+ * Description : header file for trickle.cpp - continuous low-impact scanning
+ * Author      : Bart Sjerps <bart@dirty-cache.com>
+ * License     : GPLv3+, https://www.gnu.org/licenses/gpl-3.0.txt
+ * Disclaimer  : GPLv3+
+ * URL         : https://wiki.dirty-cache.com/qdda
+ ******************************************************************************/
+
+#pragma once
+
+#include <string>
+
+#include "tools.h"
+#include "database.h"
+#include "qdda.h"
+
+/*******************************************************************************
+ * Trickle - rolling scan of a set of files/devices (--trickle), in rounds of a
+ * few extents per file at a low bandwidth. State is kept in the database
+ * (tables trickle and estimates) so a restarted trickle continues where it was.
+ * - a pass covers all extents of all files once, in a pseudo-random order (a
+ *   new permutation per pass). Each round takes the next slice of the
+ *   permutation of every file, proportional to the file size, so the coverage
+ *   is the same for all files
+ * - the kv table holds the data of the current pass (cleared when a new pass
+ *   starts), the pass-to-date ratios are calculated after each round
+ * - the rolling estimate blends the history (decayed average of completed
+ *   passes) with the current pass, weighted by the decay times the pass
+ *   coverage, so it is continuous when a pass completes
+ * A different file list, file size or extent/round size starts over.
+ ******************************************************************************/
+
+struct TrickleRatios {
+  double thin;
+  double dedupe;
+  double compr;
+  double combined() const { return thin * dedupe * compr; }
+};
+
+class Trickle {
+public:
+  Trickle(QddaDB& db, const v_FileData& files, int64 extentbytes, int64 roundbytes);
+  void  plan(v_FileData& files);  // set the extents (FileData::ranges) of the next round
+  void  done();                   // round is merged: update and save the estimates
+  int64 pass;                     // current pass (1 = first)
+  int64 round;                    // rounds completed in this pass
+  int64 rounds;                   // rounds per pass
+private:
+  void  newpass(bool restart);    // start a new pass, restart = forget the history
+  void  save();                   // save state
+  QddaDB&            db;
+  std::string        signature;   // file names and sizes, extent and round size
+  std::vector<int64> extents;     // extents per file
+  int64              extentbytes;
+  uint64             seed;        // extent order of the current pass
+  bool               history;     // estimates of completed passes available
+  TrickleRatios      h;           // history (decayed average of completed passes)
+};
@@ -0,0 +1,407 @@
+/*******************************************************************************
+ * Title       : vfs.cpp
+ * Description : SQLite VFS for qdda (coalesced writes, preallocation)
+ * Author      : Bart Sjerps <bart@dirty-cache.com>
+ * License     : GPLv3+
+ * Disclaimer  : See https://www.gnu.org/licenses/gpl-3.0.txt
+ * More info   : https://wiki.dirty-cache.com/qdda
+ ******************************************************************************/
+
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <map>
+#include <vector>
+#include <mutex>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "sqlite/sqlite3.h"
+#include "error.h"
+#include "tools.h"
+#include "vfs.h"
+
+/*******************************************************************************
+ * I/O counters - each open file keeps its own counters (no locking needed as
+ * SQLite serializes access per connection), they are added to the global
+ * list when the file is closed. Temp files are counted together as "temp".
+ ******************************************************************************/
+
+struct VfsStats {
+  int64 opens;   // number of times opened
+  int64 reads;   // read calls
+  int64 rbytes;  // bytes read
+  int64 writes;  // write calls from SQLite (pages)
+  int64 wbytes;  // bytes written by SQLite
+  int64 iowrites;// physical writes after coalescing
+  int64 syncs;   // sync calls
+  int64 allocs;  // fallocate calls
+  int64 abytes;  // bytes preallocated
+};
+
+static std::map<std::string, VfsStats> vfsstats; // counters per file (basename)
+static std::mutex    vfsstats_lock;
+static sqlite3_vfs*  defaultvfs = 0;              // the VFS we replace (unix)
+static sqlite3_vfs   qddavfs;
+static bool          vfsdropcache = false;        // drop temp file data from page cache
+
+struct QddaFile {
+  sqlite3_file base;   // must be first, SQLite sees this part
+  sqlite3_file* real;  // same file opened by the default VFS, for locking (NULL for temp files)
+  int          fd;     // file descriptor
+  bool         temp;   // temp file or delete on close
+  bool         grow;   // preallocate (databases and temp files, not journals)
+  const char*  path;   // filename, owned by SQLite and valid until close
+  char*        buf;    // write buffer, allocated on first write
+  int64        bufoff; // file offset of buffer
+  int          buflen; // bytes in buffer
+  int64        alloc;  // file is preallocated up to here
+  VfsStats     stats;
+};
+
+/*******************************************************************************
+ * Closing any descriptor of a file drops all POSIX locks the process holds on
+ * it, including those of the default VFS for other connections to the same
+ * file. So our descriptors are only closed when the last QddaFile on the
+ * inode is closed (same as the unix VFS does for its own descriptors).
+ ******************************************************************************/
+
+struct VfsInode {
+  int              refs;    // open QddaFiles with locking
+  std::vector<int> unused;  // descriptors waiting for the last close
+};
+
+static std::map<std::pair<dev_t, ino_t>, VfsInode> vfsinodes;
+static std::mutex vfsinodes_lock;
+
+static std::pair<dev_t, ino_t> vfsInodeKey(int fd) {
+  struct stat st;
+  if(fstat(fd, &st)) return std::make_pair((dev_t)0, (ino_t)0);
+  return std::make_pair(st.st_dev, st.st_ino);
+}
+
+static void vfsInodeOpen(int fd) {
+  std::lock_guard<std::mutex> lock(vfsinodes_lock);
+  vfsinodes[vfsInodeKey(fd)].refs++;
+}
+
+static void vfsInodeClose(int fd) {
+  std::lock_guard<std::mutex> lock(vfsinodes_lock);
+  auto it = vfsinodes.find(vfsInodeKey(fd));
+  if(it == vfsinodes.end()) { close(fd); return; }
+  it->second.unused.push_back(fd);
+  if(--it->second.refs > 0) return;
+  for(size_t i=0; i<it->second.unused.size(); i++) close(it->second.unused[i]);
+  vfsinodes.erase(it);
+}
+
+/*******************************************************************************
+ * Low level I/O
+ ******************************************************************************/
+
+// grow the allocation beyond the end of the data so the filesystem can
+// keep the file contiguous. The extent grows with the file (min..max)
+// KEEP_SIZE means SQLite never sees the preallocated space
+static void vfsAllocate(QddaFile* p, int64 end) {
+  if(!p->grow || end <= p->alloc) return;
+  int64 ext = std::min<int64>(kvfs_maxalloc, std::max<int64>(kvfs_minalloc, end));
+  int64 newalloc = divRoundUp(end + ext, kvfs_minalloc) * kvfs_minalloc;
+  if(fallocate(p->fd, FALLOC_FL_KEEP_SIZE, p->alloc, newalloc - p->alloc) == 0) {
+    p->stats.allocs++;
+    p->stats.abytes += newalloc - p->alloc;
+    p->alloc = newalloc;
+  } else {
+    p->alloc = INT64_MAX; // not supported by the filesystem, don't try again
+  }
+}
+
+static int vfsPwrite(QddaFile* p, const char* src, int64 len, int64 off) {
+  vfsAllocate(p, off + len);
+  for(int64 done = 0; done < len; ) {
+    ssize_t n = pwrite(p->fd, src + done, len - done, off + done);
+    if(n < 0 && errno == EINTR) continue;
+    if(n < 0 && errno == ENOSPC) return SQLITE_FULL;
+    if(n <= 0) return SQLITE_IOERR_WRITE;
+    done += n;
+  }
+  p->stats.iowrites++;
+  // sort/temp data is read back at most once, don't let it push scan data out
+  // of the page cache. Dirty pages cannot be dropped so write them out first
+  if(p->temp && vfsdropcache) {
+    sync_file_range(p->fd, off, len, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(p->fd, off, len, POSIX_FADV_DONTNEED);
+  }
+  return SQLITE_OK;
+}
+
+static int vfsFlush(QddaFile* p) {
+  if(!p->buflen) return SQLITE_OK;
+  int rc = vfsPwrite(p, p->buf, p->buflen, p->bufoff);
+  p->buflen = 0;
+  return rc;
+}
+
+/*******************************************************************************
+ * sqlite3_io_methods
+ ******************************************************************************/
+
+static int vfsClose(sqlite3_file* f) {
+  QddaFile* p = (QddaFile*)f;
+  int rc = vfsFlush(p);
+  struct stat st;
+  // release preallocated space beyond the end of the file
+  if(!p->temp && p->stats.allocs && fstat(p->fd, &st) == 0) ftruncate(p->fd, st.st_size);
+  if(p->real) {
+    p->real->pMethods->xClose(p->real); // releases its locks
+    vfsInodeClose(p->fd);
+  }
+  else close(p->fd);
+  sqlite3_free(p->buf);
+
+  std::string name = "temp";
+  if(!p->temp) {
+    name = p->path;
+    size_t pos = name.find_last_of('/');
+    if(pos != std::string::npos) name = name.substr(pos + 1);
+  }
+  std::lock_guard<std::mutex> lock(vfsstats_lock);
+  VfsStats& s = vfsstats[name];
+  s.opens    += p->stats.opens;
+  s.reads    += p->stats.reads;
+  s.rbytes   += p->stats.rbytes;
+  s.writes   += p->stats.writes;
+  s.wbytes   += p->stats.wbytes;
+  s.iowrites += p->stats.iowrites;
+  s.syncs    += p->stats.syncs;
+  s.allocs   += p->stats.allocs;
+  s.abytes   += p->stats.abytes;
+  return rc;
+}
+
+// flush first if the read overlaps buffered data
+static int vfsRead(sqlite3_file* f, void* dst, int amt, sqlite3_int64 off) {
+  QddaFile* p = (QddaFile*)f;
+  if(p->buflen && off < p->bufoff + p->buflen && off + amt > p->bufoff) {
+    int rc = vfsFlush(p);
+    if(rc != SQLITE_OK) return rc;
+  }
+  char* buf = (char*)dst;
+  int got = 0;
+  while(got < amt) {
+    ssize_t n = pread(p->fd, buf + got, amt - got, off + got);
+    if(n < 0 && errno == EINTR) continue;
+    if(n < 0) return SQLITE_IOERR_READ;
+    if(n == 0) break;
+    got += n;
+  }
+  p->stats.reads++;
+  p->stats.rbytes += got;
+  if(got < amt) {
+    memset(buf + got, 0, amt - got); // SQLite requires the rest to be zero filled
+    return SQLITE_IOERR_SHORT_READ;
+  }
+  return SQLITE_OK;
+}
+
+// writes that extend or overwrite the buffered range go into the buffer,
+// anything else flushes the buffer and starts a new one
+static int vfsWrite(sqlite3_file* f, const void* src, int amt, sqlite3_int64 off) {
+  QddaFile* p = (QddaFile*)f;
+  p->stats.writes++;
+  p->stats.wbytes += amt;
+  if(p->buflen) {
+    if(off >= p->bufoff && off <= p->bufoff + p->buflen && off + amt <= p->bufoff + kvfs_buffer) {
+      memcpy(p->buf + (off - p->bufoff), src, amt);
+      p->buflen = std::max<int64>(p->buflen, off + amt - p->bufoff);
+      return SQLITE_OK;
+    }
+    int rc = vfsFlush(p);
+    if(rc != SQLITE_OK) return rc;
+  }
+  if(!p->buf && amt < kvfs_buffer) p->buf = (char*)sqlite3_malloc(kvfs_buffer);
+  if(!p->buf || amt >= kvfs_buffer) return vfsPwrite(p, (const char*)src, amt, off);
+  memcpy(p->buf, src, amt);
+  p->bufoff = off;
+  p->buflen = amt;
+  return SQLITE_OK;
+}
+
+static int vfsTruncate(sqlite3_file* f, sqlite3_int64 size) {
+  QddaFile* p = (QddaFile*)f;
+  int rc = vfsFlush(p);
+  if(rc != SQLITE_OK) return rc;
+  if(ftruncate(p->fd, size)) return SQLITE_IOERR_TRUNCATE;
+  p->alloc = std::min<int64>(p->alloc, size); // truncate also releases preallocated space
+  return SQLITE_OK;
+}
+
+static int vfsSync(sqlite3_file* f, int flags) {
+  QddaFile* p = (QddaFile*)f;
+  int rc = vfsFlush(p);
+  if(rc != SQLITE_OK) return rc;
+  p->stats.syncs++;
+  if(!p->temp && fdatasync(p->fd)) return SQLITE_IOERR_FSYNC;
+  return SQLITE_OK;
+}
+
+static int vfsFileSize(sqlite3_file* f, sqlite3_int64* size) {
+  QddaFile* p = (QddaFile*)f;
+  int rc = vfsFlush(p);
+  if(rc != SQLITE_OK) return rc;
+  struct stat st;
+  if(fstat(p->fd, &st)) return SQLITE_IOERR_FSTAT;
+  *size = st.st_size;
+  return SQLITE_OK;
+}
+
+// Locking is done by the default VFS on its own descriptor of the file, temp
+// files are private and need no locking.
+// Unlock ends a transaction, make the data visible to other connections first
+static int vfsLock(sqlite3_file* f, int level) {
+  QddaFile* p = (QddaFile*)f;
+  return p->real ? p->real->pMethods->xLock(p->real, level) : SQLITE_OK;
+}
+
+static int vfsUnlock(sqlite3_file* f, int level) {
+  QddaFile* p = (QddaFile*)f;
+  int rc = vfsFlush(p);
+  if(rc != SQLITE_OK) return rc;
+  return p->real ? p->real->pMethods->xUnlock(p->real, level) : SQLITE_OK;
+}
+
+static int vfsCheckReservedLock(sqlite3_file* f, int* out) {
+  QddaFile* p = (QddaFile*)f;
+  if(p->real) return p->real->pMethods->xCheckReservedLock(p->real, out);
+  *out = 0;
+  return SQLITE_OK;
+}
+
+// lock related controls (lock state, has moved etc.) go to the default VFS
+static int vfsFileControl(sqlite3_file* f, int op, void* arg) {
+  QddaFile* p = (QddaFile*)f;
+  if(op == SQLITE_FCNTL_SIZE_HINT) { vfsAllocate(p, *(sqlite3_int64*)arg); return SQLITE_OK; }
+  if(op == SQLITE_FCNTL_VFSNAME)   { *(char**)arg = sqlite3_mprintf("%s", qddavfs.zName); return SQLITE_OK; }
+  if(op == SQLITE_FCNTL_CHUNK_SIZE) return SQLITE_OK; // we preallocate ourselves
+  if(p->real) return p->real->pMethods->xFileControl(p->real, op, arg);
+  return SQLITE_NOTFOUND;
+}
+
+static int vfsSectorSize(sqlite3_file* f)             { return 4096; }
+static int vfsDeviceCharacteristics(sqlite3_file* f) { return 0; }
+
+static const sqlite3_io_methods vfsMethods = {
+  1,                // iVersion - no shared memory (WAL) and no mmap
+  vfsClose, vfsRead, vfsWrite, vfsTruncate, vfsSync, vfsFileSize,
+  vfsLock, vfsUnlock, vfsCheckReservedLock, vfsFileControl,
+  vfsSectorSize, vfsDeviceCharacteristics,
+  0, 0, 0, 0, 0, 0
+};
+
+/*******************************************************************************
+ * sqlite3_vfs functions
+ ******************************************************************************/
+
+// same search order as the unix VFS, temp_store_directory pragma first
+static const char* vfsTempDir() {
+  const char* dirs[] = { sqlite3_temp_directory, getenv("SQLITE_TMPDIR"), getenv("TMPDIR"), "/var/tmp", "/usr/tmp", "/tmp" };
+  struct stat st;
+  for(size_t i=0; i<sizeof(dirs)/sizeof(dirs[0]); i++) {
+    if(!dirs[i] || stat(dirs[i], &st) || !S_ISDIR(st.st_mode)) continue;
+    if(access(dirs[i], W_OK | X_OK) == 0) return dirs[i];
+  }
+  return ".";
+}
+
+static int vfsOpen(sqlite3_vfs* vfs, const char* name, sqlite3_file* f, int flags, int* outflags) {
+  QddaFile* p = (QddaFile*)f;
+  memset(p, 0, sizeof(QddaFile));
+
+  if(!name) { // temp file, SQLite leaves naming to the VFS
+    std::string tmpname = std::string(vfsTempDir()) + "/qdda_tmp_XXXXXX";
+    p->fd = mkstemp(&tmpname[0]);
+    if(p->fd >= 0) unlink(tmpname.c_str());
+    p->temp = true;
+  } else if(flags & SQLITE_OPEN_DELETEONCLOSE) {
+    int oflags = O_CLOEXEC;
+    if(flags & SQLITE_OPEN_EXCLUSIVE) oflags |= O_EXCL;
+    if(flags & SQLITE_OPEN_CREATE)    oflags |= O_CREAT;
+    oflags |= (flags & SQLITE_OPEN_READWRITE) ? O_RDWR : O_RDONLY;
+    p->fd = open(name, oflags, 0644);
+    if(p->fd >= 0) unlink(name);
+    p->temp = true;
+  } else {
+    // the default VFS opens (and creates) the file first and does the locking,
+    // we use our own descriptor for I/O
+    p->real = (sqlite3_file*)((char*)p + sizeof(QddaFile));
+    int realflags = 0;
+    int rc = defaultvfs->xOpen(defaultvfs, name, p->real, flags, &realflags);
+    if(rc != SQLITE_OK) {
+      if(p->real->pMethods) p->real->pMethods->xClose(p->real);
+      return rc;
+    }
+    flags = realflags; // may be read-only
+    p->fd = open(name, O_CLOEXEC | ((flags & SQLITE_OPEN_READWRITE) ? O_RDWR : O_RDONLY));
+    if(p->fd < 0) {
+      p->real->pMethods->xClose(p->real);
+      return SQLITE_CANTOPEN;
+    }
+    vfsInodeOpen(p->fd);
+  }
+  if(p->fd < 0) return SQLITE_CANTOPEN;
+  p->grow = !name || (flags & (SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_TEMP_DB | SQLITE_OPEN_TRANSIENT_DB));
+
+  struct stat st;
+  if(fstat(p->fd, &st) == 0) p->alloc = st.st_size;
+  p->path = name;
+  p->stats.opens = 1;
+  p->base.pMethods = &vfsMethods;
+  if(outflags) *outflags = flags;
+  return SQLITE_OK;
+}
+
+/*******************************************************************************
+ * Public functions
+ ******************************************************************************/
+
+// copy the default VFS so all non-file functions (access, delete, randomness,
+// time etc.) are handled as before, only replace the file handling
+void vfsRegister(bool dropcache) {
+  if(defaultvfs) return;
+  defaultvfs = sqlite3_vfs_find(0);
+  if(!defaultvfs) throw ERROR("SQLite default VFS not found");
+  qddavfs          = *defaultvfs;
+  qddavfs.iVersion = std::min(defaultvfs->iVersion, 2); // no system call overrides
+  qddavfs.szOsFile = sizeof(QddaFile) + defaultvfs->szOsFile; // the real file follows ours
+  qddavfs.pNext    = 0;
+  qddavfs.zName    = "qdda";
+  qddavfs.xOpen    = vfsOpen;
+  vfsdropcache     = dropcache;
+  if(sqlite3_vfs_register(&qddavfs, 1) != SQLITE_OK) throw ERROR("Cannot register SQLite VFS");
+}
+
+// format: <epoch> vfs.<file>.<counter> <value>
+void vfsMetrics(std::ostream& os) {
+  std::lock_guard<std::mutex> lock(vfsstats_lock);
+  int64 now = epoch();
+  for(auto it = vfsstats.begin(); it != vfsstats.end(); ++it) {
+    const std::string prefix = " vfs." + it->first + ".";
+    const VfsStats& s = it->second;
+    os << now << prefix << "opens "    << s.opens    << "\n"
+       << now << prefix << "reads "    << s.reads    << "\n"
+       << now << prefix << "rbytes "   << s.rbytes   << "\n"
+       << now << prefix << "writes "   << s.writes   << "\n"
+       << now << prefix << "wbytes "   << s.wbytes   << "\n"
+       << now << prefix << "iowrites " << s.iowrites << "\n"
+       << now << prefix << "syncs "    << s.syncs    << "\n"
+       << now << prefix << "allocs "   << s.allocs   << "\n"
+       << now << prefix << "abytes "   << s.abytes   << "\n";
+  }
+  os << std::flush;
+}
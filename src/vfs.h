@@ -0,0 +1,39 @@
+/*******************************************************************************
+ * Title       : vfs.h
+ * Description : header file for vfs.cpp - SQLite VFS for qdda
+ * Author      : Bart Sjerps <bart@dirty-cache.com>
+ * License     : GPLv3+, https://www.gnu.org/licenses/gpl-3.0.txt
+ * Disclaimer  : GPLv3+
+ * URL         : https://wiki.dirty-cache.com/qdda
+ ******************************************************************************/
+
+#pragma once
+
+#include <ostream>
+
+#include "tools.h"
+
+const int kvfs_buffer   = 1048576;  // write coalescing buffer per open file
+const int kvfs_minalloc = 1048576;  // preallocate at least this much beyond EOF
+const int kvfs_maxalloc = 67108864; // and at most this much (64MiB)
+
+/*******************************************************************************
+ * The "qdda" VFS replaces SQLite's unix VFS for all qdda databases. qdda only
+ * uses a database from a single process with journaling and syncing disabled,
+ * so it can trade generality for large sequential I/O:
+ * - page writes are collected in a buffer and written in large chunks,
+ *   the buffer is flushed before reads from the same range, size checks,
+ *   truncate, sync, unlock and close
+ * - files are preallocated (fallocate, keep size) in growing extents
+ * - temp files (sorting during merge) are created in the SQLite temp
+ *   directory and optionally dropped from the page cache after writing
+ *   (fadvise, not O_DIRECT: the sorter's I/O is not aligned), so the VFS
+ *   reports a plain 4K sector size and no device characteristics
+ * - databases are also opened by the default (unix) VFS, which does the file
+ *   locking, so other processes (e.g. sqlite3) see consistent data
+ * - no shared memory (WAL) and no mmap
+ * Everything not file related is passed to the default (unix) VFS.
+ ******************************************************************************/
+
+void vfsRegister(bool dropcache);  // register as default VFS, call before opening databases
+void vfsMetrics(std::ostream& os); // print I/O counters per file in metrics format